@@ -0,0 +1,898 @@
+
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "sfs.h"
+
+#define BENCH_DISK             "bench.sfs"
+#define BENCH_DISK_SIZE        (BLOCK_SIZE * 32768) //128 MiB
+#define BENCH_FILE_SIZE        (64 * 1024 * 1024)
+#define BENCH_RANDOM_READS     65536
+#define BENCH_MAX_DEPTH        64
+#define BENCH_SMALL_FILE       (1024 * 1024)
+#define BENCH_SMALL_READ       100
+#define BENCH_SMALL_READS      200000
+#define BENCH_CHURN_FILES      64         //files alive at once in the churn workload
+#define BENCH_MOUNTS           10
+#define BENCH_CHUNK            (1024 * 1024)
+
+static double now() {
+    
+    struct timespec time;
+    
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+//a run cannot go on without its image, a failed format or mount ends the benchmark
+static void bench_failed(char* what, sfs_status status) {
+    
+    fprintf(stderr, "sfs_bench: cannot %s %s: %s\n", what, BENCH_DISK, sfs_strerror(status));
+    
+    remove(BENCH_DISK);
+    exit(1);
+}
+
+//formats and mounts the image of the fixed suite
+static SFS* bench_open(u8 io_mode) {
+    
+    sfs_status status = format_sfs(BENCH_DISK, BENCH_DISK_SIZE, BLOCK_SIZE, SFS_BYTES_PER_INODE, SFS_FORMAT_PREALLOCATE);
+    
+    if(status != SFS_OK) { bench_failed("format", status); }
+    
+    SFS* fs = open_sfs(BENCH_DISK, io_mode);
+    
+    if(fs == NULL) { bench_failed("mount", sfs_last_error()); }
+    
+    return fs;
+}
+
+//writes and reads back one file in chunks of request_size bytes
+static void bench_sequential(u8 io_mode, u32 request_size) {
+    
+    char* buffer = malloc(BENCH_FILE_SIZE);
+    
+    memset(buffer, 0xab, BENCH_FILE_SIZE);
+    
+    SFS* fs = bench_open(io_mode);
+    
+    io_stats before, after;
+    
+    //write
+    get_io_stats(fs, &before);
+    
+    double start = now();
+    
+    sfs_file* file = sfs_open_path(fs, "/bench", SFS_MODE_WRITE);
+    
+    for(u32 i = 0; i < BENCH_FILE_SIZE; i += request_size) {
+        sfs_write_file(buffer + i, (BENCH_FILE_SIZE - i < request_size) ? BENCH_FILE_SIZE - i : request_size, file);
+    }
+    
+    sfs_close_file(file);
+    sync_sfs(fs);
+    
+    double write_time = now() - start;
+    
+    get_io_stats(fs, &after);
+    
+    u64 write_calls = (after.reads + after.writes) - (before.reads + before.writes);
+    
+    //read
+    get_io_stats(fs, &before);
+    
+    start = now();
+    
+    file = sfs_open_path(fs, "/bench", SFS_MODE_READ);
+    
+    for(u32 i = 0; i < BENCH_FILE_SIZE; i += request_size) {
+        sfs_read_file(buffer + i, (BENCH_FILE_SIZE - i < request_size) ? BENCH_FILE_SIZE - i : request_size, file);
+    }
+    
+    sfs_close_file(file);
+    
+    double read_time = now() - start;
+    
+    get_io_stats(fs, &after);
+    
+    u64 read_calls = (after.reads + after.writes) - (before.reads + before.writes);
+    
+    close_sfs(fs);
+    
+    double mib = BENCH_FILE_SIZE / (1024.0 * 1024.0);
+    
+    printf("%-5s %8u B | write %8.1f MiB/s %8.1f syscalls/MiB | read %8.1f MiB/s %8.1f syscalls/MiB\n",
+           (io_mode == SFS_IO_MMAP) ? "mmap" : "stdio", request_size,
+           mib / write_time, write_calls / mib,
+           mib / read_time, read_calls / mib);
+    
+    free(buffer);
+}
+
+//reads random blocks of one file, depth 0 - synchronous sfs_pread, otherwise depth requests are kept in flight
+static void bench_random(u8 io_mode, u32 depth) {
+    
+    char* buffer = malloc(BENCH_FILE_SIZE);
+    
+    memset(buffer, 0xab, BENCH_FILE_SIZE);
+    
+    SFS* fs = bench_open(io_mode);
+    
+    sfs_file* file = sfs_open_path(fs, "/bench", SFS_MODE_WRITE);
+    
+    sfs_write_file(buffer, BENCH_FILE_SIZE, file);
+    sfs_close_file(file);
+    
+    file = sfs_open_path(fs, "/bench", SFS_MODE_READ);
+    
+    sfs_request requests[BENCH_MAX_DEPTH];
+    
+    u32 random = 1;
+    
+    if(depth != 0) {
+        sfs_set_queue_depth(fs, depth);
+    }
+    
+    double start = now();
+    
+    for(u32 i = 0; i < BENCH_RANDOM_READS; i++) {
+        
+        random = random * 1103515245 + 12345;
+        
+        u32 block = (random >> 8) % (BENCH_FILE_SIZE / BLOCK_SIZE);
+        
+        if(depth == 0) {
+            sfs_pread(file, buffer + block * BLOCK_SIZE, BLOCK_SIZE, block * BLOCK_SIZE);
+            continue;
+        }
+        
+        //reuse the oldest request
+        if(i >= depth) {
+            sfs_wait_request(&requests[i % depth]);
+        }
+        
+        sfs_pread_async(file, buffer + block * BLOCK_SIZE, BLOCK_SIZE, block * BLOCK_SIZE, &requests[i % depth], NULL, NULL);
+    }
+    
+    for(u32 i = 0; depth != 0 && i < depth && i < BENCH_RANDOM_READS; i++) {
+        sfs_wait_request(&requests[i]);
+    }
+    
+    double read_time = now() - start;
+    
+    async_stats stats;
+    
+    get_async_stats(fs, &stats);
+    
+    sfs_close_file(file);
+    close_sfs(fs);
+    
+    printf("%-5s random %4u B | depth %3u | read %8.1f MiB/s | %3u in flight at most\n",
+           (io_mode == SFS_IO_MMAP) ? "mmap" : "stdio", BLOCK_SIZE, depth,
+           BENCH_RANDOM_READS * (BLOCK_SIZE / (1024.0 * 1024.0)) / read_time, stats.max_in_flight);
+    
+    free(buffer);
+}
+
+//latency of small reads of an open file and of open, read and close by path, heap allocations per operation
+static void bench_small_reads(u8 io_mode) {
+    
+    char buffer[BENCH_SMALL_READ];
+    
+    SFS* fs = bench_open(io_mode);
+    
+    char* data = calloc(1, BENCH_SMALL_FILE);
+    
+    sfs_file* file = sfs_open_path(fs, "/small", SFS_MODE_WRITE);
+    
+    sfs_write_file(data, BENCH_SMALL_FILE, file);
+    sfs_close_file(file);
+    
+    file = sfs_open_path(fs, "/small", SFS_MODE_READ);
+    
+    memory_stats before, after;
+    
+    u32 random = 1;
+    
+    //warm up, handle arrays and the pool are filled
+    sfs_pread(file, buffer, BENCH_SMALL_READ, 0);
+    
+    get_memory_stats(fs, &before);
+    
+    double start = now();
+    
+    for(u32 i = 0; i < BENCH_SMALL_READS; i++) {
+        
+        random = random * 1103515245 + 12345;
+        
+        sfs_pread(file, buffer, BENCH_SMALL_READ, (random >> 8) % (BENCH_SMALL_FILE - BENCH_SMALL_READ));
+    }
+    
+    double read_time = now() - start;
+    
+    sfs_close_file(file);
+    
+    start = now();
+    
+    for(u32 i = 0; i < BENCH_SMALL_READS; i++) {
+        
+        random = random * 1103515245 + 12345;
+        
+        file = sfs_open_path(fs, "/small", SFS_MODE_READ);
+        
+        sfs_pread(file, buffer, BENCH_SMALL_READ, (random >> 8) % (BENCH_SMALL_FILE - BENCH_SMALL_READ));
+        
+        sfs_close_file(file);
+    }
+    
+    double open_time = now() - start;
+    
+    get_memory_stats(fs, &after);
+    
+    close_sfs(fs);
+    
+    printf("%-5s small %4u B | pread %8.0f ns | open, pread, close %8.0f ns | %6.3f allocations per operation\n",
+           (io_mode == SFS_IO_MMAP) ? "mmap" : "stdio", BENCH_SMALL_READ,
+           read_time * 1e9 / BENCH_SMALL_READS, open_time * 1e9 / BENCH_SMALL_READS,
+           (double)(after.allocations - before.allocations) / (2 * BENCH_SMALL_READS));
+    
+    free(data);
+}
+
+//formats an image of disk_size bytes, prints time and space taken on the host disk
+static void bench_format(u8 format_mode, u64 disk_size) {
+    
+    char* names[] = { "zero", "sparse", "prealloc" };
+    
+    double start = now();
+    
+    sfs_status status = format_sfs(BENCH_DISK, disk_size, BLOCK_SIZE, SFS_BYTES_PER_INODE, format_mode);
+    
+    if(status != SFS_OK) { bench_failed("format", status); }
+    
+    double format_time = now() - start;
+    
+    struct stat disk_stat;
+    
+    stat(BENCH_DISK, &disk_stat);
+    
+    printf("format %-8s %6llu MiB | %8.3f s | %8llu MiB allocated\n", names[format_mode],
+           disk_size / (1024 * 1024), format_time, (u64)disk_stat.st_blocks * 512 / (1024 * 1024));
+}
+
+/*WORKLOAD GENERATOR*/
+
+//sfs_bench -w workload[,workload...] [-i stdio|mmap|both] [-r request] [-f file size] [-d disk size] [-b block size] [-p bytes per inode] [-n operations] [-s seed] [-j]
+//sizes take K, M and G suffixes, -j prints one JSON object per run instead of a table row
+
+typedef struct bench_options {
+    u8   io_mode;
+    u32  request_size; //0 - default of the workload
+    u64  file_size;
+    u64  disk_size;    //0 - default of the workload
+    u32  block_size;   //0 - BLOCK_SIZE
+    u32  bytes_per_inode; //0 - SFS_BYTES_PER_INODE
+    u32  operations;   //0 - default of the workload
+    u32  seed;
+    bool json;
+} bench_options;
+
+//timed part of one run, latencies has one entry per operation
+typedef struct bench_result {
+    char*    workload;
+    u32      request_size;
+    u64      disk_size;
+    u32      operations;
+    u64      bytes;
+    double   seconds;
+    double*  latencies;
+    io_stats io;
+} bench_result;
+
+typedef bool (*bench_workload)(bench_options* options, bench_result* result); //false if the run failed, its row is not printed
+
+static u64 random_state;
+
+static u32 next_random() {
+    
+    random_state = random_state * 6364136223846793005ULL + 1442695040888963407ULL;
+    
+    return random_state >> 33;
+}
+
+//0 if text is not a size from 1 to max
+static u64 parse_size(char* text, u64 max) {
+    
+    char* end;
+    
+    if(*text < '0' || *text > '9') { return 0; }
+    
+    u64 size  = strtoull(text, &end, 10);
+    u32 shift = 0;
+    
+    switch(*end) {
+        case 'G': case 'g': shift += 10;
+        case 'M': case 'm': shift += 10;
+        case 'K': case 'k': shift += 10; end++;
+    }
+    
+    if(*end != '\0' || size > (max >> shift)) { return 0; }
+    
+    return size << shift;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    
+    double x = *(double*)a;
+    double y = *(double*)b;
+    
+    return (x > y) - (x < y);
+}
+
+//adds the I/O done since before to the result
+static void add_io(bench_result* result, io_stats* before, io_stats* after) {
+    
+    result->io.reads         += after->reads         - before->reads;
+    result->io.writes        += after->writes        - before->writes;
+    result->io.bytes_read    += after->bytes_read    - before->bytes_read;
+    result->io.bytes_written += after->bytes_written - before->bytes_written;
+    result->io.syncs         += after->syncs         - before->syncs;
+}
+
+static SFS* bench_mount(bench_options* options, bench_result* result) {
+    
+    sfs_status status = format_sfs(BENCH_DISK, result->disk_size, options->block_size, options->bytes_per_inode, SFS_FORMAT_PREALLOCATE);
+    
+    if(status != SFS_OK) { bench_failed("format", status); }
+    
+    SFS* fs = open_sfs(BENCH_DISK, options->io_mode);
+    
+    if(fs == NULL) { bench_failed("mount", sfs_last_error()); }
+    
+    return fs;
+}
+
+//reports why a workload stopped, its row is not printed
+static bool workload_failed(bench_result* result, char* what) {
+    
+    fprintf(stderr, "sfs_bench: %s: %s failed: %s\n", result->workload, what, sfs_strerror(sfs_last_error()));
+    
+    return false;
+}
+
+//writes size bytes to path outside of the timed part
+static bool prepare_file(SFS* fs, char* path, u64 size) {
+    
+    char* buffer = malloc(BENCH_CHUNK);
+    
+    memset(buffer, 0xab, BENCH_CHUNK);
+    
+    sfs_file* file = sfs_open_path(fs, path, SFS_MODE_WRITE);
+    
+    u64 written = 0;
+    
+    for(u64 i = 0; file != NULL && i < size; i += BENCH_CHUNK) {
+        written += sfs_write_file(buffer, (size - i < BENCH_CHUNK) ? size - i : BENCH_CHUNK, file);
+    }
+    
+    bool prepared = file != NULL && sfs_close_file(file) == SFS_OK && sync_sfs(fs) == SFS_OK && written == size;
+    
+    free(buffer);
+    
+    if(!prepared) {
+        fprintf(stderr, "sfs_bench: cannot write %llu bytes: %s\n", size, sfs_strerror(sfs_last_error()));
+    }
+    
+    return prepared;
+}
+
+//writes the file in requests of request_size bytes, the close and sync are part of the time
+//bytes are counted once the close has written the buffered ones
+static bool workload_seq_write(bench_options* options, bench_result* result) {
+    
+    SFS* fs = bench_mount(options, result);
+    
+    char* buffer = malloc(result->request_size);
+    
+    memset(buffer, 0xab, result->request_size);
+    
+    io_stats before, after;
+    
+    get_io_stats(fs, &before);
+    
+    double start = now();
+    
+    sfs_file* file    = sfs_open_path(fs, "/bench", SFS_MODE_WRITE);
+    u64       written = 0;
+    
+    for(u32 i = 0; file != NULL && i < result->operations; i++) {
+        
+        double op_start = now();
+        
+        written              += sfs_write_file(buffer, result->request_size, file);
+        result->latencies[i]  = now() - op_start;
+    }
+    
+    bool done = file != NULL && sfs_close_file(file) == SFS_OK && sync_sfs(fs) == SFS_OK &&
+                written == (u64)result->operations * result->request_size;
+    
+    result->seconds = now() - start;
+    result->bytes   = written;
+    
+    get_io_stats(fs, &after);
+    add_io(result, &before, &after);
+    
+    close_sfs(fs);
+    free(buffer);
+    
+    return done || workload_failed(result, "write");
+}
+
+//reads the file front to back with sfs_read_file
+static bool workload_seq_read(bench_options* options, bench_result* result) {
+    
+    SFS* fs = bench_mount(options, result);
+    
+    if(!prepare_file(fs, "/bench", (u64)result->operations * result->request_size)) { close_sfs(fs); return false; }
+    
+    char* buffer = malloc(result->request_size);
+    
+    io_stats before, after;
+    
+    get_io_stats(fs, &before);
+    
+    double start = now();
+    
+    sfs_file* file = sfs_open_path(fs, "/bench", SFS_MODE_READ);
+    
+    for(u32 i = 0; file != NULL && i < result->operations; i++) {
+        
+        double op_start = now();
+        
+        result->bytes        += sfs_read_file(buffer, result->request_size, file);
+        result->latencies[i]  = now() - op_start;
+    }
+    
+    bool done = file != NULL && sfs_close_file(file) == SFS_OK &&
+                result->bytes == (u64)result->operations * result->request_size;
+    
+    result->seconds = now() - start;
+    
+    get_io_stats(fs, &after);
+    add_io(result, &before, &after);
+    
+    close_sfs(fs);
+    free(buffer);
+    
+    return done || workload_failed(result, "read");
+}
+
+//reads or overwrites requests at random aligned offsets of a file of file_size bytes
+static bool random_access(bench_options* options, bench_result* result, bool write) {
+    
+    SFS* fs = bench_mount(options, result);
+    
+    if(!prepare_file(fs, "/bench", options->file_size)) { close_sfs(fs); return false; }
+    
+    char* buffer = malloc(result->request_size);
+    
+    memset(buffer, 0xcd, result->request_size);
+    
+    u32 slots = options->file_size / result->request_size;
+    
+    if(slots == 0) { slots = 1; }
+    
+    sfs_file* file = sfs_open_path(fs, "/bench", SFS_MODE_READ);
+    
+    io_stats before, after;
+    
+    get_io_stats(fs, &before);
+    
+    double start = now();
+    
+    for(u32 i = 0; file != NULL && i < result->operations; i++) {
+        
+        u32 offset = (next_random() % slots) * result->request_size;
+        
+        double op_start = now();
+        
+        if(write) {
+            result->bytes += sfs_pwrite(file, buffer, result->request_size, offset);
+        } else {
+            result->bytes += sfs_pread(file, buffer, result->request_size, offset);
+        }
+        
+        result->latencies[i] = now() - op_start;
+    }
+    
+    bool done = file != NULL && sfs_close_file(file) == SFS_OK && (!write || sync_sfs(fs) == SFS_OK);
+    
+    result->seconds = now() - start;
+    
+    get_io_stats(fs, &after);
+    add_io(result, &before, &after);
+    
+    close_sfs(fs);
+    free(buffer);
+    
+    return done || workload_failed(result, write ? "write" : "read");
+}
+
+static bool workload_rand_read(bench_options* options, bench_result* result) {
+    return random_access(options, result, false);
+}
+
+static bool workload_rand_write(bench_options* options, bench_result* result) {
+    return random_access(options, result, true);
+}
+
+//appends request_size bytes to BENCH_CHURN_FILES files in turn, handles stay open
+//bytes are counted once the closes have written the buffered ones
+static bool workload_append(bench_options* options, bench_result* result) {
+    
+    SFS* fs = bench_mount(options, result);
+    
+    char* buffer  = malloc(result->request_size);
+    char  path[32];
+    bool  done    = true;
+    u64   written = 0;
+    
+    memset(buffer, 0xab, result->request_size);
+    
+    sfs_file* files[BENCH_CHURN_FILES];
+    
+    for(u32 i = 0; i < BENCH_CHURN_FILES; i++) {
+        
+        sprintf(path, "/append%u", i);
+        
+        files[i] = sfs_open_path(fs, path, SFS_MODE_WRITE);
+        done     = done && files[i] != NULL;
+    }
+    
+    io_stats before, after;
+    
+    get_io_stats(fs, &before);
+    
+    double start = now();
+    
+    for(u32 i = 0; done && i < result->operations; i++) {
+        
+        double op_start = now();
+        
+        written              += sfs_write_file(buffer, result->request_size, files[i % BENCH_CHURN_FILES]);
+        result->latencies[i]  = now() - op_start;
+    }
+    
+    for(u32 i = 0; i < BENCH_CHURN_FILES; i++) {
+        
+        if(files[i] != NULL) {
+            done = sfs_close_file(files[i]) == SFS_OK && done;
+        }
+    }
+    
+    done = done && sync_sfs(fs) == SFS_OK && written == (u64)result->operations * result->request_size;
+    
+    result->seconds = now() - start;
+    result->bytes   = written;
+    
+    get_io_stats(fs, &after);
+    add_io(result, &before, &after);
+    
+    close_sfs(fs);
+    free(buffer);
+    
+    return done || workload_failed(result, "append");
+}
+
+//every operation creates a file of request_size bytes and deletes the one created BENCH_CHURN_FILES operations earlier
+static bool workload_churn(bench_options* options, bench_result* result) {
+    
+    SFS* fs = bench_mount(options, result);
+    
+    char* buffer = malloc(result->request_size);
+    char  path[32];
+    bool  done   = sfs_mkdir(fs, "/churn") != 0;
+    
+    memset(buffer, 0xab, result->request_size);
+    
+    io_stats before, after;
+    
+    get_io_stats(fs, &before);
+    
+    double start = now();
+    
+    for(u32 i = 0; done && i < result->operations; i++) {
+        
+        double op_start = now();
+        
+        if(i >= BENCH_CHURN_FILES) {
+            
+            sprintf(path, "/churn/%u", i - BENCH_CHURN_FILES);
+            
+            done = sfs_unlink(fs, path) != 0;
+        }
+        
+        sprintf(path, "/churn/%u", i);
+        
+        sfs_file* file    = done ? sfs_open_path(fs, path, SFS_MODE_WRITE) : NULL;
+        u32       written = (file != NULL) ? sfs_write_file(buffer, result->request_size, file) : 0;
+        
+        done = file != NULL && sfs_close_file(file) == SFS_OK && written == result->request_size;
+        
+        result->bytes        += done ? written : 0;
+        result->latencies[i]  = now() - op_start;
+    }
+    
+    done = done && sync_sfs(fs) == SFS_OK;
+    
+    result->seconds = now() - start;
+    
+    get_io_stats(fs, &after);
+    add_io(result, &before, &after);
+    
+    close_sfs(fs);
+    free(buffer);
+    
+    return done || workload_failed(result, "create");
+}
+
+//mounts a clean image holding a thousand files, one operation is one open_sfs
+static bool workload_mount(bench_options* options, bench_result* result) {
+    
+    SFS* fs = bench_mount(options, result);
+    
+    char path[32];
+    bool done = true;
+    
+    for(u32 i = 0; done && i < 1000; i++) {
+        
+        sprintf(path, "/%u", i);
+        
+        sfs_file* file = sfs_open_path(fs, path, SFS_MODE_WRITE);
+        
+        done = file != NULL && sfs_close_file(file) == SFS_OK;
+    }
+    
+    done = close_sfs(fs) == SFS_OK && done;
+    
+    if(!done) { return workload_failed(result, "create"); }
+    
+    io_stats stats;
+    io_stats none = { 0 };
+    
+    for(u32 i = 0; i < result->operations; i++) {
+        
+        double op_start = now();
+        
+        fs = open_sfs(BENCH_DISK, options->io_mode);
+        
+        if(fs == NULL) { bench_failed("mount", sfs_last_error()); }
+        
+        result->latencies[i]  = now() - op_start;
+        result->seconds      += result->latencies[i];
+        
+        get_io_stats(fs, &stats);
+        add_io(result, &none, &stats);
+        
+        close_sfs(fs);
+    }
+    
+    return true;
+}
+
+typedef struct bench_workload_info {
+    char*          name;
+    bench_workload run;
+    u32            request_size;
+    u32            operations; //0 - file size divided by the request size
+} bench_workload_info;
+
+static bench_workload_info workloads[] = {
+    { "seq-write",  workload_seq_write,  64 * 1024,  0            },
+    { "seq-read",   workload_seq_read,   64 * 1024,  0            },
+    { "rand-read",  workload_rand_read,  BLOCK_SIZE, 65536        },
+    { "rand-write", workload_rand_write, BLOCK_SIZE, 65536        },
+    { "append",     workload_append,     100,        200000       },
+    { "churn",      workload_churn,      BLOCK_SIZE, 20000        },
+    { "mount",      workload_mount,      0,          BENCH_MOUNTS },
+};
+
+//images mounted when no disk size is given
+static u64 mount_sizes[] = { 64ULL << 20, 1ULL << 30, 16ULL << 30 };
+
+//runs one workload and prints its line, false if it failed
+static bool run_workload(bench_workload_info* info, bench_options* options, u64 disk_size) {
+    
+    bench_result result = { 0 };
+    
+    result.workload     = info->name;
+    result.request_size = (options->request_size != 0) ? options->request_size : info->request_size;
+    result.disk_size    = disk_size;
+    result.operations   = (options->operations   != 0) ? options->operations   : info->operations;
+    
+    if(result.operations == 0) {
+        result.operations = (options->file_size + result.request_size - 1) / result.request_size;
+    }
+    
+    result.latencies    = calloc(result.operations, sizeof(double));
+    
+    if(result.latencies == NULL) {
+        fprintf(stderr, "sfs_bench: cannot keep latencies of %u operations\n", result.operations);
+        exit(1);
+    }
+    
+    random_state = options->seed;
+    
+    if(!info->run(options, &result)) {
+        free(result.latencies);
+        return false;
+    }
+    
+    qsort(result.latencies, result.operations, sizeof(double), compare_doubles);
+    
+    double p50 = result.latencies[(result.operations - 1) * 50ULL / 100] * 1e6;
+    double p99 = result.latencies[(result.operations - 1) * 99ULL / 100] * 1e6;
+    
+    double mib_per_second = (result.seconds > 0) ? result.bytes / (1024.0 * 1024.0) / result.seconds : 0;
+    double ops_per_second = (result.seconds > 0) ? result.operations / result.seconds : 0;
+    
+    u64  syscalls = result.io.reads + result.io.writes + result.io.syncs;
+    char* io_name = (options->io_mode == SFS_IO_MMAP) ? "mmap" : "stdio";
+    
+    if(options->json) {
+        printf("{\"version\": %u, \"workload\": \"%s\", \"io\": \"%s\", \"request\": %u, \"disk\": %llu, \"block\": %u, \"operations\": %u, "
+               "\"bytes\": %llu, \"seconds\": %.6f, \"mib_per_s\": %.2f, \"ops_per_s\": %.1f, \"p50_us\": %.2f, \"p99_us\": %.2f, "
+               "\"reads\": %llu, \"writes\": %llu, \"syncs\": %llu, \"bytes_read\": %llu, \"bytes_written\": %llu}\n",
+               SFS_VERSION, result.workload, io_name, result.request_size, result.disk_size,
+               (options->block_size != 0) ? options->block_size : BLOCK_SIZE, result.operations,
+               result.bytes, result.seconds, mib_per_second, ops_per_second, p50, p99,
+               result.io.reads, result.io.writes, result.io.syncs, result.io.bytes_read, result.io.bytes_written);
+    } else {
+        printf("%-10s %-5s %6llu MiB disk %8u B | %8.1f MiB/s %10.0f ops/s | p50 %9.1f us p99 %9.1f us | %8.2f syscalls/op\n",
+               result.workload, io_name, result.disk_size >> 20, result.request_size, mib_per_second, ops_per_second, p50, p99,
+               (double)syscalls / result.operations);
+    }
+    
+    fflush(stdout);
+    
+    free(result.latencies);
+    
+    return true;
+}
+
+//runs the comma separated workloads in both I/O modes or only in the selected one
+static int run_workloads(char* names, bench_options* options, bool both_modes) {
+    
+    u32 count        = sizeof(workloads) / sizeof(bench_workload_info);
+    u64 default_size = BENCH_DISK_SIZE;
+    
+    for(char* name = strtok(names, ","); name != NULL; name = strtok(NULL, ",")) {
+        
+        bool all   = strcmp(name, "all") == 0;
+        bool found = all;
+        
+        for(u32 i = 0; i < count; i++) {
+            
+            if(!all && strcmp(name, workloads[i].name) != 0) { continue; }
+            
+            found = true;
+            
+            u64* sizes       = &options->disk_size;
+            u32  sizes_count = 1;
+            
+            if(options->disk_size == 0) {
+                
+                bool mount  = workloads[i].run == workload_mount;
+                
+                sizes       = mount ? mount_sizes : &default_size;
+                sizes_count = mount ? sizeof(mount_sizes) / sizeof(u64) : 1;
+            }
+            
+            for(u32 j = 0; j < sizes_count; j++) {
+                
+                bool done = true;
+                
+                if(both_modes || options->io_mode == SFS_IO_STDIO) {
+                    options->io_mode = SFS_IO_STDIO; done = run_workload(&workloads[i], options, sizes[j]);
+                }
+                
+                if(done && (both_modes || options->io_mode == SFS_IO_MMAP)) {
+                    options->io_mode = SFS_IO_MMAP;  done = run_workload(&workloads[i], options, sizes[j]);
+                }
+                
+                if(!done) {
+                    remove(BENCH_DISK);
+                    return 1;
+                }
+            }
+        }
+        
+        if(!found) {
+            fprintf(stderr, "sfs_bench: unknown workload %s\n", name);
+            return 1;
+        }
+    }
+    
+    remove(BENCH_DISK);
+    
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    
+    if(argc > 1) {
+        
+        bench_options options = { SFS_IO_STDIO, 0, BENCH_FILE_SIZE, 0, 0, 0, 0, 1, false };
+        
+        char* names      = "all";
+        bool  both_modes = false;
+        
+        for(int option; (option = getopt(argc, argv, "w:i:r:f:d:b:p:n:s:j")) != -1;) {
+            
+            //0 means the default in the options, an explicit value must be at least 1
+            bool valid = true;
+            
+            switch(option) {
+                case 'w': names                = optarg;                                      break;
+                case 'i': options.io_mode      = strcmp(optarg, "mmap") == 0;
+                          both_modes           = strcmp(optarg, "both") == 0;
+                          valid                = options.io_mode || both_modes || strcmp(optarg, "stdio") == 0; break;
+                case 'r': valid = (options.request_size    = parse_size(optarg, 0xffffffff)) != 0; break;
+                case 'f': valid = (options.file_size       = parse_size(optarg, 0xffffffff)) != 0; break;
+                case 'd': valid = (options.disk_size       = parse_size(optarg, ~0ULL))      != 0; break;
+                case 'b': valid = (options.block_size      = parse_size(optarg, 0xffffffff)) != 0; break;
+                case 'p': valid = (options.bytes_per_inode = parse_size(optarg, 0xffffffff)) != 0; break;
+                case 'n': valid = (options.operations      = parse_size(optarg, 0xffffffff)) != 0; break;
+                case 's': options.seed         = strtoul(optarg, NULL, 10);                   break;
+                case 'j': options.json         = true;                                        break;
+                default:
+                    fprintf(stderr, "usage: %s [-w workload,...|all] [-i stdio|mmap|both] [-r request] [-f file size] [-d disk size] [-b block size] [-p bytes per inode] [-n operations] [-s seed] [-j]\n", argv[0]);
+                    return 1;
+            }
+            
+            if(!valid) {
+                fprintf(stderr, "sfs_bench: invalid value %s for -%c\n", optarg, option);
+                return 1;
+            }
+        }
+        
+        return run_workloads(names, &options, both_modes);
+    }
+    
+    //zeroing 16 GiB would take most of the run, it is timed on 1 GiB only
+    bench_format(SFS_FORMAT_ZERO,        1ULL  << 30);
+    bench_format(SFS_FORMAT_SPARSE,      1ULL  << 30);
+    bench_format(SFS_FORMAT_SPARSE,      16ULL << 30);
+    bench_format(SFS_FORMAT_PREALLOCATE, 1ULL  << 30);
+    bench_format(SFS_FORMAT_PREALLOCATE, 16ULL << 30);
+    
+    u32 request_sizes[] = { 1000, BLOCK_SIZE, 16 * BLOCK_SIZE, 256 * BLOCK_SIZE };
+    
+    for(u32 i = 0; i < sizeof(request_sizes) / sizeof(u32); i++) {
+        bench_sequential(SFS_IO_STDIO, request_sizes[i]);
+    }
+    
+    for(u32 i = 0; i < sizeof(request_sizes) / sizeof(u32); i++) {
+        bench_sequential(SFS_IO_MMAP, request_sizes[i]);
+    }
+    
+    bench_small_reads(SFS_IO_STDIO);
+    bench_small_reads(SFS_IO_MMAP);
+    
+    u32 depths[] = { 0, 1, 8, BENCH_MAX_DEPTH };
+    
+    for(u32 i = 0; i < sizeof(depths) / sizeof(u32); i++) {
+        bench_random(SFS_IO_STDIO, depths[i]);
+    }
+    
+    for(u32 i = 0; i < sizeof(depths) / sizeof(u32); i++) {
+        bench_random(SFS_IO_MMAP, depths[i]);
+    }
+    
+    remove(BENCH_DISK);
+    
+    return 0;
+}
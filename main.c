@@ -3,20 +3,29 @@
 
 #include "sfs.h"
 
+static void log_error(sfs_status status, const char* message, void* user_data) {
+    fprintf(stderr, "%s: %s\n", message, sfs_strerror(status));
+}
+
 int main(int argc, char* argv[]) {
     
+    sfs_set_log_callback(log_error, NULL);
+    
     char write_buffer[] = "Wothfak u sajd tu mí jů litr bich?!";
     char* read_buffer   = calloc(100, 1);
     
-    format_sfs("disk.sfs", BLOCK_SIZE * 4);
+    format_sfs("disk.sfs", BLOCK_SIZE * 16, BLOCK_SIZE, SFS_BYTES_PER_INODE, SFS_FORMAT_ZERO);
+    
+    //pass "mmap" to use memory mapped disk instead of stdio
+    SFS* fs = open_sfs("disk.sfs", (argc > 1 && strcmp(argv[1], "mmap") == 0) ? SFS_IO_MMAP : SFS_IO_STDIO);
     
-    open_sfs("disk.sfs");
+    if(fs == NULL) { return 1; }
     
-    printf("Disk info: [blocks: %u] [inode blocks: %u] [inodes: %u]\n", sfs.blocks, sfs.inode_blocks, sfs.inodes);
+    printf("Disk info: [blocks: %u] [inode blocks: %u] [inodes: %u]\n", fs->blocks, fs->inode_blocks, fs->inodes);
     
     
     
-    sfs_file* out = sfs_open_file(0, SFS_MODE_WRITE);
+    sfs_file* out = sfs_open_path(fs, "/hello.txt", SFS_MODE_WRITE);
     
     sfs_write_file(write_buffer, strlen(write_buffer), out);
     
@@ -24,7 +33,7 @@ int main(int argc, char* argv[]) {
     
     sfs_close_file(out);
     
-    sfs_file* in = sfs_open_file(0, SFS_MODE_READ);
+    sfs_file* in = sfs_open_path(fs, "/hello.txt", SFS_MODE_READ);
     
     sfs_read_file(read_buffer, 80, in);
     
@@ -33,6 +42,6 @@ int main(int argc, char* argv[]) {
     sfs_close_file(in);
     
     
-    close_sfs();
+    close_sfs(fs);
     
 }
@@ -1,717 +1,4103 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+
 #include "sfs.h"
 
-#define SFS_ERROR(x)           printf(x); return
-#define SFS_NULL_ERROR(x)      printf(x); return NULL
-#define SFS_ZERO_ERROR(x)      printf(x); return 0
+//failed calls record the status in the thread's last error and return the status, NULL or 0
+#define SFS_ERROR(s,x)         return sfs_fail(s, x)
+#define SFS_NULL_ERROR(s,x)    return (sfs_fail(s, x), NULL)
+#define SFS_ZERO_ERROR(s,x)    return (sfs_fail(s, x), 0)
 
 #define SFS_NULL               0
 
+#define LOG_LENGTH             160 //longest formatted log message
+
 #define MY_DEBUG               printf
 
-/*DISK IMPLEMENTATION*/
 
-//format simple file system
-void format_sfs(char* emu_disk_file, u32 disk_size) {
+
+//all macros expect the filesystem handle in fs
+//block size is a power of two read at runtime, divisions by it and by the counts below compile to shifts and masks
+#define FS_BLOCK_SIZE          (1U << fs->block_shift)
+#define PER_BLOCK(type)        (1U << (fs->block_shift - __builtin_ctz(sizeof(type)))) //type must have power of two size
+
+#define INODES_PER_BLOCK       PER_BLOCK(inode)
+#define EXTENTS_PER_BLOCK      (PER_BLOCK(extent) - 1) //extents stored in one extent block, last slot links the next one
+
+#define BLOCK_USED(i)          GET_BIT64(*bitmap_word(fs, i), (i) % BITMAP_WORD_BITS)
+#define MARK_BLOCK(i,z)        mark_block(fs, i, z)
+#define FREE_BLOCK(i)          (SET_BIT64(fs->pending_free[(i) / BITMAP_WORD_BITS], (i) % BITMAP_WORD_BITS, 1), fs->pending_free_num++, \
+                                SET_BIT64(fs->pending_dirty[(i) / BITMAP_BLOCK_BITS / BITMAP_WORD_BITS], (i) / BITMAP_BLOCK_BITS % BITMAP_WORD_BITS, 1))
+
+#define BITMAP_BLOCK_BITS      (FS_BLOCK_SIZE * 8) //blocks described by one bitmap block
+#define BITMAP_BLOCK_WORDS     PER_BLOCK(u64)      //bitmap words in one bitmap block
+
+#define BITMAP_WORDS           ((fs->blocks - 1) / BITMAP_WORD_BITS + 1)
+
+#define INODE_PAGE_WORDS       ((fs->inode_blocks - 1) / BITMAP_WORD_BITS + 1)
+
+#define BITMAP_START           (1 + fs->inode_blocks)             //first block of the on-disk bitmap
+#define JOURNAL_START          (BITMAP_START + fs->bitmap_blocks) //journal descriptor, block images follow it
+#define DATA_START             (JOURNAL_START + fs->journal_blocks) //first block usable by files
+
+#define BITMAP_DIRTY_WORDS     ((fs->bitmap_blocks - 1) / BITMAP_WORD_BITS + 1)
+
+#define JOURNAL_MAGIC          0x4a524e4c
+#define JOURNAL_MAX_BLOCKS     (PER_BLOCK(u32) - 3) //block images described by one descriptor
+#define JOURNAL_MIN_BLOCKS     4
+#define JOURNAL_CAPACITY       ((fs->journal_blocks - 1 < JOURNAL_MAX_BLOCKS) ? fs->journal_blocks - 1 : JOURNAL_MAX_BLOCKS)
+
+#define INODE_LOCK(i)          (&fs->inode_locks[(i) % SFS_INODE_LOCKS])
+
+#define DIR_SLOT_EMPTY         0          //inode of a never used directory slot
+#define DIR_SLOT_DELETED       0xffffffff //inode of a removed directory entry
+#define DIR_MIN_SLOTS          PER_BLOCK(dir_entry)
+
+#define APPEND_LOCAL_BLOCKS    (SFS_APPEND_BUFFER / SFS_MIN_BLOCK_SIZE + 1) //blocks of one append kept on the stack
+
+#define EXTENT_SEARCH_RUNS     32 //free runs looked at by one search for a long enough run
+
+#define READAHEAD_MIN_BLOCKS   4  //first read-ahead window of a sequentially read file
+
+#define SCAN_BATCH_BLOCKS      16 //inode blocks read at once by the scan
+
+#if SFS_STATS
+#define STAT_ADD(x,n)          __atomic_add_fetch(&(x), (n), __ATOMIC_RELAXED)
+#define STAT_COUNT(x,n)        ((x) += (n))                       //counter guarded by a lock the caller holds
+#define STAT_TIMER(t)          u64 t = stat_clock()
+#define STAT_LATENCY(h,t)      histogram_add(&(h), stat_clock() - (t))
+#else
+#define STAT_ADD(x,n)
+#define STAT_COUNT(x,n)
+#define STAT_TIMER(t)
+#define STAT_LATENCY(h,t)
+#endif
+
+/*ERRORS*/
+
+static __thread sfs_status last_error;
+
+static sfs_log_callback log_callback;
+static void*            log_user_data;
+static time_t           log_second;     //second of the messages counted in log_count
+static u32              log_count;
+static u32              log_suppressed; //messages dropped since the last one logged
+static pthread_mutex_t  log_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//passes the message to the log callback unless the rate limit is reached
+static void log_message(sfs_status status, const char* message) {
     
-    //check disk size validity
-    if(disk_size % BLOCK_SIZE != 0)
-    {
-        SFS_ERROR("format_sfs() error: disk size is not multiple of 4096\n");
+    pthread_mutex_lock(&log_lock);
+    
+    time_t second = time(NULL);
+    
+    if(second != log_second) {
+        log_second = second;
+        log_count  = 0;
     }
-    if(disk_size < BLOCK_SIZE * 3)
-    {
-        SFS_ERROR("format_sfs() error: disk size is not sufficient enough (note: must be bigger than 3 * 4096 bytes\n");
+    
+    if(log_callback != NULL && log_count < SFS_LOG_RATE) {
+        
+        log_count++;
+        
+        if(log_suppressed != 0) {
+            log_callback(SFS_OK, "sfs: earlier messages were suppressed by the log rate limit", log_user_data);
+            log_suppressed = 0;
+        }
+        
+        log_callback(status, message, log_user_data);
+        
+    } else {
+        log_suppressed++;
     }
     
-    //setup sfs disk
-    sfs.disk         = fopen(emu_disk_file, "wb"); if(sfs.disk == NULL) { SFS_ERROR("format_sfs error: cannot open emulated drive\n"); }
-    sfs.magic        = MAGIC_NUMBER;
-    sfs.blocks       = disk_size / BLOCK_SIZE;
-    sfs.inode_blocks = ceil(sfs.blocks * 0.1);
-    sfs.inodes       = sfs.inode_blocks * BLOCK_SIZE / sizeof(inode);
+    pthread_mutex_unlock(&log_lock);
+}
+
+//records the status of a failed call, the message goes to the log callback if there is one
+//nothing is formatted, messages are constant strings
+static sfs_status sfs_fail(sfs_status status, const char* message) {
     
-    //write sfs header
-    fwrite((char*)&sfs, sizeof(sfs) - sizeof(FILE*), 1, sfs.disk);
+    last_error = status;
+    
+    if(__atomic_load_n(&log_callback, __ATOMIC_RELAXED) != NULL) {
+        log_message(status, message);
+    }
     
-    //fill rest of the emulated disk with zeros
-    char* buffer = calloc(BLOCK_SIZE, sizeof(char));
+    return status;
+}
+
+//formats a message for the log callback, the last error is not touched
+//it is formatted only when a callback is set
+__attribute__((format(printf, 2, 3)))
+static void sfs_log(sfs_status status, const char* format, ...) {
     
-    //fill rest of the first block
-    fwrite(buffer, sizeof(char), BLOCK_SIZE - sizeof(sfs) + sizeof(FILE*), sfs.disk);
+    if(__atomic_load_n(&log_callback, __ATOMIC_RELAXED) == NULL) { return; }
     
-    //fill rest of the blocks with zeros
-    for(u32 i = 0; i < sfs.blocks; i++)
-    {
-        fwrite(buffer, sizeof(char), BLOCK_SIZE, sfs.disk);
-    }
+    char    message[LOG_LENGTH];
+    va_list arguments;
     
-    free(buffer);
+    va_start(arguments, format);
+    vsnprintf(message, sizeof(message), format, arguments);
+    va_end(arguments);
     
-    fclose(sfs.disk);
+    log_message(status, message);
 }
 
-//open disk
-void open_sfs(char* emu_disk_file) {
+sfs_status sfs_last_error(void) {
+    return last_error;
+}
+
+void sfs_clear_error(void) {
+    last_error = SFS_OK;
+}
+
+const char* sfs_strerror(sfs_status status) {
     
-    sfs.disk = fopen(emu_disk_file, "r+b");
+    switch(status) {
+        case SFS_OK:           return "success";
+        case SFS_EINVAL:       return "invalid argument";
+        case SFS_ENOENT:       return "no such file or directory";
+        case SFS_EEXIST:       return "file exists";
+        case SFS_EISDIR:       return "is a directory";
+        case SFS_ENOTDIR:      return "not a directory";
+        case SFS_ENOTEMPTY:    return "directory not empty";
+        case SFS_ENAMETOOLONG: return "file name too long";
+        case SFS_ENOSPC:       return "no space left on device";
+        case SFS_ENOMEM:       return "out of memory";
+        case SFS_EIO:          return "input/output error";
+        case SFS_EFORMAT:      return "disk is not formatted with this version of simple file system";
+        case SFS_EFBIG:        return "file too large";
+        case SFS_ECORRUPT:     return "file system is inconsistent";
+    }
     
-    //read super block
-    fread((char*)&sfs, sizeof(sfs) - sizeof(FILE*), 1, sfs.disk);
+    return "unknown error";
+}
+
+void sfs_set_log_callback(sfs_log_callback callback, void* user_data) {
     
-    //check header
-    if(sfs.magic != MAGIC_NUMBER)
-    {
-        SFS_ERROR("open_sfs error: read disk is not simple file system formatted\n");
-    }
+    pthread_mutex_lock(&log_lock);
     
-    //allocate header block and inodes blocks
-    g_free_block_bitmap = calloc((sfs.blocks - 1) / 8 + 1, sizeof(char));
+    log_user_data = user_data;
     
-    SET_BIT(g_free_block_bitmap[0], 0, 1);
+    __atomic_store_n(&log_callback, callback, __ATOMIC_RELAXED);
     
-    for(u32 i = 1; i < sfs.inode_blocks + 1; i++)
-    {
-        SET_BIT(g_free_block_bitmap[i / 8], i % 8, 1);
-    }
+    pthread_mutex_unlock(&log_lock);
+}
+
+//heap allocations made by file operations are counted, steady state reads and writes make none
+static void* fs_malloc(SFS* fs, u64 size) {
     
-    //scan inodes for allocated blocks
-    fseek(sfs.disk, BLOCK_SIZE, SEEK_SET);
+    STAT_ADD(fs->memory_counters.allocations, 1);
     
-    inode node;
+    return malloc(size);
+}
+
+static void* fs_calloc(SFS* fs, u64 count, u64 size) {
     
-    for(u32 i = 0; i < sfs.inode_blocks; i++) {
-        
-        for(u32 j = 0; j < BLOCK_SIZE / sizeof(inode); j++) {
-            
-            //load node
-            fread((char*)&node, sizeof(node), 1, sfs.disk);
-            
-            //check node allocation
-            if(node.valid) {
-                
-                //scan direct links
-                for(u32 k = 0; k < 5; k++) {
-                    
-                    if(node.direct[k] != SFS_NULL) {
-                        
-                        if(node.direct[k] % BLOCK_SIZE != 0) {
-                            SFS_ERROR("open_sfs error: node direct pointer points to invalid block, system corrupted\n");
-                        }
-                        
-                        u32 block_index = node.direct[k] / BLOCK_SIZE;
-                        
-                        SET_BIT(g_free_block_bitmap[block_index / 8], block_index % 8, 1);
-                        
-                    }
-                }
-                
-                //scan indirect link
-                if(node.indirect != SFS_NULL) {
-                    
-                    if(node.indirect % BLOCK_SIZE != 0) {
-                        SFS_ERROR("open_sfs error: node indirect pointer points to invalid block, system corrupted\n");
-                    }
-                    
-                    //save file pointer
-                    //don't know what is this for :D
-                    //u32 node_add = ftell(sfs.disk);
-                    
-                    //set file pointer to the indirect block
-                    fseek(sfs.disk, node.indirect, SEEK_SET);
-                    
-                    //read pointers and allocate blocks
-                    u32   indirect_pointer;
-                    
-                    for(u32 k = 0; k < BLOCK_SIZE / sizeof(u32); k += 1) {
-                        
-                        fread((char*)&indirect_pointer, sizeof(u32), 1, sfs.disk);
-                        
-                        if(indirect_pointer != SFS_NULL) {
-                            
-                            if(indirect_pointer % BLOCK_SIZE != 0) {
-                                SFS_ERROR("open_sfs error: node indirect pointer in indirect array points to invalid block, system corrupted\n");
-                            }
-                            
-                            u32 block_index = indirect_pointer / BLOCK_SIZE;
-                            
-                            SET_BIT(g_free_block_bitmap[block_index / 8], block_index % 8, 1);
-                            
-                        }
-                    }
-                }
-            }
-        }
-    }
+    STAT_ADD(fs->memory_counters.allocations, 1);
+    
+    return calloc(count, size);
 }
 
-//close disk
-void close_sfs() {
+static void* fs_realloc(SFS* fs, void* pointer, u64 size) {
+    
+    STAT_ADD(fs->memory_counters.allocations, 1);
     
-    fclose(sfs.disk);
-    free(g_free_block_bitmap);
+    return realloc(pointer, size);
 }
 
-//read block
-u32 read_block(void* buffer, u32 block_index, u32 size) {
+//file blocks touched by bytes [offset, offset + size)
+typedef struct block_range {
+    u32 first;  //index of the first block
+    u32 offset; //offset in the first block
+    u32 count;  //number of blocks, 0 for an empty range
+    u32 tail;   //bytes used in the last block
+} block_range;
 
-    if(block_index + 1 > sfs.blocks) {
-        SFS_ZERO_ERROR("read_block error: block index out of range\n");
-    }
+//maps a byte range of a file to blocks, integer only, offset must be below MAX_FILE_SIZE(fs)
+static block_range map_range(SFS* fs, u64 offset, u32 size) {
+    
+    block_range range = { offset / FS_BLOCK_SIZE, offset % FS_BLOCK_SIZE, 0, 0 };
+    
+    if(size == 0) { return range; }
+    
+    u64 last = offset + size - 1;
+    
+    range.count = last / FS_BLOCK_SIZE - range.first + 1;
+    range.tail  = last % FS_BLOCK_SIZE + 1;
+    
+    return range;
+}
 
-    if(size > BLOCK_SIZE) {
-        SFS_ZERO_ERROR("read_block error: buffer size is bigger than block size\n");
+//copies a struct of u64 counters updated with STAT_ADD, every counter is read atomically
+static void stat_copy(void* destination, void* source, u32 bytes) {
+    
+    for(u32 i = 0; i < bytes / sizeof(u64); i++) {
+        ((u64*)destination)[i] = __atomic_load_n((u64*)source + i, __ATOMIC_RELAXED);
     }
-
-    fseek(sfs.disk, block_index * BLOCK_SIZE, SEEK_SET);
-
-    return fread(buffer, sizeof(char), size, sfs.disk);
 }
 
-u32 write_block(void* buffer, u32 block_index, u32 size) {
+#if SFS_STATS
 
-    if(block_index + 1 > sfs.blocks) {
-        SFS_ZERO_ERROR("write_block error: block index out of range\n");
-    }
+static u64 stat_clock() {
+    
+    struct timespec time;
+    
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    
+    return time.tv_sec * 1000000000ULL + time.tv_nsec;
+}
 
-    if(size > BLOCK_SIZE) {
-        SFS_ZERO_ERROR("write_block error: buffer size is bigger than block size\n");
+static void histogram_add(latency_histogram* histogram, u64 ns) {
+    
+    u32 bucket = 63 - __builtin_clzll(ns | 1);
+    
+    if(bucket >= SFS_HISTOGRAM_BUCKETS) {
+        bucket = SFS_HISTOGRAM_BUCKETS - 1;
     }
+    
+    STAT_ADD(histogram->count, 1);
+    STAT_ADD(histogram->total_ns, ns);
+    STAT_ADD(histogram->buckets[bucket], 1);
+    
+    u64 max = __atomic_load_n(&histogram->max_ns, __ATOMIC_RELAXED);
+    
+    while(ns > max && !__atomic_compare_exchange_n(&histogram->max_ns, &max, ns, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
 
-    fseek(sfs.disk, block_index * BLOCK_SIZE, SEEK_SET);
+#endif
 
-    return fwrite(buffer, sizeof(char), size, sfs.disk);
+//all disk I/O is positional, threads never share a file position
+static u32 disk_read(SFS* fs, void* buffer, u32 block_index, u32 size) {
+    
+    ssize_t bytes = pread(fileno(fs->disk), buffer, size, (u64)block_index * FS_BLOCK_SIZE);
+    
+    STAT_ADD(fs->io_counters.reads, 1);
+    
+    if(bytes < 0) { SFS_ZERO_ERROR(SFS_EIO, "sfs disk error: read failed"); }
+    
+    STAT_ADD(fs->io_counters.bytes_read, bytes);
+    STAT_ADD(fs->op_counters.blocks_read, map_range(fs, 0, bytes).count);
+    
+    return bytes;
 }
 
-u32 get_free_node() {
-
-    for(u32 i = 0; i < (sfs.blocks - 1) / 8 + 1; i++) {
+static u32 disk_write(SFS* fs, void* buffer, u32 block_index, u32 size) {
+    
+    ssize_t bytes = pwrite(fileno(fs->disk), buffer, size, (u64)block_index * FS_BLOCK_SIZE);
+    
+    STAT_ADD(fs->io_counters.writes, 1);
+    
+    if(bytes < 0) { SFS_ZERO_ERROR(SFS_EIO, "sfs disk error: write failed"); }
+    
+    STAT_ADD(fs->io_counters.bytes_written, bytes);
+    STAT_ADD(fs->op_counters.blocks_written, map_range(fs, 0, bytes).count);
+    
+    return bytes;
+}
 
-        for(u8 j = 0; j < 8; j++) {
+//positional vectored read
+static u32 disk_readv(SFS* fs, struct iovec* iov, int iov_num, u64 offset) {
+    
+    ssize_t bytes = preadv(fileno(fs->disk), iov, iov_num, offset);
+    
+    STAT_ADD(fs->io_counters.reads, 1);
+    
+    if(bytes < 0) { SFS_ZERO_ERROR(SFS_EIO, "sfs disk error: read failed"); }
+    
+    STAT_ADD(fs->io_counters.bytes_read, bytes);
+    STAT_ADD(fs->op_counters.blocks_read, map_range(fs, offset % FS_BLOCK_SIZE, bytes).count);
+    
+    return bytes;
+}
 
-            if(i * 8 + j + 1 > sfs.blocks) {
+static u32 disk_writev(SFS* fs, struct iovec* iov, int iov_num, u64 offset) {
+    
+    ssize_t bytes = pwritev(fileno(fs->disk), iov, iov_num, offset);
+    
+    STAT_ADD(fs->io_counters.writes, 1);
+    
+    if(bytes < 0) { SFS_ZERO_ERROR(SFS_EIO, "sfs disk error: write failed"); }
+    
+    STAT_ADD(fs->io_counters.bytes_written, bytes);
+    STAT_ADD(fs->op_counters.blocks_written, map_range(fs, offset % FS_BLOCK_SIZE, bytes).count);
+    
+    return bytes;
+}
 
-                SFS_ZERO_ERROR("get_free_node error: out of physical memory\n");
-            }
+//records a lost write, sync_sfs and close_sfs report it from then on
+static void disk_failed(SFS* fs) {
+    __atomic_store_n(&fs->io_failed, 1, __ATOMIC_RELAXED);
+}
 
-            //if node free return it's index
-            if(!GET_BIT(g_free_block_bitmap[i], j)) {
-                
-                return i * 8 + j;
-            }
-        }
+//waits until everything written so far is on disk
+static bool disk_barrier(SFS* fs) {
+    
+    int result;
+    
+    if(fs->io_mode == SFS_IO_MMAP) {
+        result = msync(fs->map, fs->map_size, MS_SYNC);
+    } else {
+        result = fdatasync(fileno(fs->disk));
     }
-
-    SFS_ZERO_ERROR("get_free_node error: out of physical memory\n");
+    
+    STAT_ADD(fs->io_counters.syncs, 1);
+    
+    if(result != 0) {
+        disk_failed(fs);
+        SFS_ZERO_ERROR(SFS_EIO, "sfs disk error: sync failed");
+    }
+    
+    return true;
 }
 
-/*FILE IMPLEMENTATION*/
+/*BLOCK CACHE*/
 
-//TODO: implement modes, now only supporing "wb"
-//opens file if doesn't exist create it
-sfs_file* sfs_open_file (u32 index, u8 mode) {
+static void cache_init(SFS* fs) {
     
-    if(index > sfs.inodes) {
-        SFS_NULL_ERROR("sfs_open_file error: index out of range\n");
+    fs->cache_memory = malloc(SFS_CACHE_BLOCKS * FS_BLOCK_SIZE);
+    fs->cache_hand   = 0;
+    
+    memset(&fs->cache_counters, 0, sizeof(fs->cache_counters));
+    
+    for(u32 i = 0; i < SFS_CACHE_BLOCKS; i++) {
+        
+        fs->cache[i].valid      = 0;
+        fs->cache[i].dirty      = 0;
+        fs->cache[i].referenced = 0;
+        fs->cache[i].next       = -1;
+        fs->cache[i].data       = fs->cache_memory + i * FS_BLOCK_SIZE;
+        
+        fs->cache_buckets[i]    = -1;
     }
+}
 
-    u32 node_index = BLOCK_SIZE + index * sizeof(inode);
-
-    //open desired node
-    fseek(sfs.disk, node_index, SEEK_SET);
-
-    inode node;
-
-    fread((char*)&node, sizeof(node), 1, sfs.disk);
-
-    //create file
-    sfs_file* file = malloc(sizeof(sfs_file));
+//false if the block could not be written, the loss is recorded with disk_failed
+static bool cache_writeback(SFS* fs, cache_block* entry) {
     
-    //check mode
-    if(!node.valid && mode == SFS_MODE_READ) {
-        SFS_NULL_ERROR("sfs_open_file error: file doesn't exist\n");
-    }
+    bool written = true;
     
-    //reset the node
-    if(!node.valid || mode == SFS_MODE_WRITE) {
+    if(entry->valid && entry->dirty) {
         
-        sfs_delet_file(index);
+        if(disk_write(fs, entry->data, entry->block_index, FS_BLOCK_SIZE) != FS_BLOCK_SIZE) {
+            disk_failed(fs);
+            written = false;
+        }
         
-        node.valid = 1;
-        node.size  = 0;
-        node.direct[0] = SFS_NULL;
-        node.direct[1] = SFS_NULL;
-        node.direct[2] = SFS_NULL;
-        node.direct[3] = SFS_NULL;
-        node.direct[4] = SFS_NULL;
-        node.indirect  = SFS_NULL;
-
-        fseek(sfs.disk, node_index, SEEK_SET);
-        fwrite((char*)&node, sizeof(node), 1, sfs.disk);
+        entry->dirty = 0;
+        STAT_COUNT(fs->cache_counters.writebacks, 1);
     }
     
-    file->data_pointer = 0;
-    file->node         = node;
-    file->inumber      = index;
+    return written;
+}
 
-    return file;
+//remove slot from its hash chain
+static void cache_unlink(SFS* fs, u32 slot) {
+    
+    int* link = &fs->cache_buckets[fs->cache[slot].block_index % SFS_CACHE_BLOCKS];
+    
+    while(*link != -1) {
+        
+        if(*link == (int)slot) {
+            *link = fs->cache[slot].next;
+            break;
+        }
+        
+        link = &fs->cache[*link].next;
+    }
+    
+    fs->cache[slot].next = -1;
 }
 
-//closes file
-void sfs_close_file(sfs_file* file) {
+//pick a victim with the clock algorithm, write it back if dirty
+static u32 cache_evict(SFS* fs) {
+    
+    while(1) {
+        
+        u32 slot = fs->cache_hand;
+        
+        fs->cache_hand = (fs->cache_hand + 1) % SFS_CACHE_BLOCKS;
+        
+        if(!fs->cache[slot].valid) { return slot; }
+        
+        if(fs->cache[slot].referenced) {
+            fs->cache[slot].referenced = 0;
+            continue;
+        }
+        
+        cache_writeback(fs, &fs->cache[slot]);
+        cache_unlink(fs, slot);
+        
+        fs->cache[slot].valid = 0;
+        STAT_COUNT(fs->cache_counters.evictions, 1);
+        
+        return slot;
+    }
+}
 
-    free(file);
-    file = NULL;
+//returns cached copy of the block, NULL if it is not cached
+static cache_block* cache_lookup(SFS* fs, u32 block_index) {
+    
+    for(int i = fs->cache_buckets[block_index % SFS_CACHE_BLOCKS]; i != -1; i = fs->cache[i].next) {
+        
+        if(fs->cache[i].block_index == block_index) {
+            
+            fs->cache[i].referenced = 1;
+            
+            return &fs->cache[i];
+        }
+    }
+    
+    return NULL;
 }
 
-//read file
-u32  sfs_read_file (void* buffer, u32 size, sfs_file* file) {
+//takes a slot for the block and links it to the bucket, its data are not loaded
+static cache_block* cache_insert(SFS* fs, u32 block_index) {
+    
+    u32          slot  = cache_evict(fs);
+    cache_block* entry = &fs->cache[slot];
+    u32          bucket = block_index % SFS_CACHE_BLOCKS;
+    
+    entry->block_index = block_index;
+    entry->valid       = 1;
+    entry->dirty       = 0;
+    entry->referenced  = 1;
+    entry->next        = fs->cache_buckets[bucket];
+    
+    fs->cache_buckets[bucket] = slot;
+    
+    return entry;
+}
 
-    if(size == 0) { return 0; }
+//drops the slot, its data are not written back
+static void cache_invalidate(SFS* fs, u32 slot) {
+    
+    cache_unlink(fs, slot);
+    
+    fs->cache[slot].valid = 0;
+    fs->cache[slot].dirty = 0;
+}
 
-    if(size > file->node.size) {
-        size = file->node.size;
+//returns cached copy of the block, load - fill it from disk on miss
+//NULL if the block cannot be read, a slot with wrong data would be written back later
+static cache_block* cache_get(SFS* fs, u32 block_index, bool load) {
+    
+    cache_block* entry = cache_lookup(fs, block_index);
+    
+    if(entry != NULL) {
+        STAT_COUNT(fs->cache_counters.hits, 1);
+        return entry;
     }
     
-    //create backup
-    sfs_file* file_copy = malloc(sizeof(sfs_file));
-    memcpy(file_copy, file, sizeof(sfs_file));
-
-    //create necessary variables
-    u32 data_index  = file->data_pointer / BLOCK_SIZE;
-    u32 data_offset = file->data_pointer % BLOCK_SIZE;
+    STAT_COUNT(fs->cache_counters.misses, 1);
     
-    u32 remaining_space_in_block = (data_offset == 0) ? 0 : BLOCK_SIZE - data_offset;
+    entry = cache_insert(fs, block_index);
     
-    u32 blocks_num  = floor(((double)size - (double)remaining_space_in_block - 1.0) / (double)BLOCK_SIZE + 1.0);
+    if(load && disk_read(fs, entry->data, block_index, FS_BLOCK_SIZE) != FS_BLOCK_SIZE) {
+        cache_invalidate(fs, entry - fs->cache);
+        SFS_NULL_ERROR(SFS_EIO, "sfs cache error: block cannot be read");
+    }
     
-    u32 reminder    = (size - remaining_space_in_block) % BLOCK_SIZE;
-    u32 bytes_read  = 0;
+    return entry;
+}
 
-    char* block_buffer   = malloc(BLOCK_SIZE);
-    char* buffer_pointer = (char*)buffer;
+//loads blocks of the range missing in the cache, every run of missing blocks is read with one I/O
+//at most half of the cache is filled so the loaded blocks are not evicted by each other
+static void cache_prefetch(SFS* fs, u32 first_block, u32 count) {
     
-    u32 temp_block_index;
+    struct iovec iov[SFS_CACHE_BLOCKS / 2];
     
-    //if there is space in block read it
-    if(remaining_space_in_block != 0) {
-        
-        //find the block which data pointer points to
-        //in direct blocks
-        if(data_index < 5) {
-            
-            temp_block_index = file_copy->node.direct[data_index] / BLOCK_SIZE;
-            
-        //indirect blocks
-        } else {
-            
-            read_block(block_buffer, file_copy->node.indirect / BLOCK_SIZE, BLOCK_SIZE);
-            
-            temp_block_index = *(u32*)(block_buffer + (data_index - 5) * sizeof(u32)) / BLOCK_SIZE;
-            
-        }
-        
-        //if the data will fit into that remaining space
-        if(blocks_num == 0) {
-            
-            read_block(block_buffer, temp_block_index, BLOCK_SIZE);
-            
-            memcpy(buffer_pointer, block_buffer + data_offset, size);
-            
-            bytes_read              += size;
-            file_copy->data_pointer += size;
-            
-        //we read the that remaining data and the proceed onto the next blocks
-        } else {
-            
-            read_block(block_buffer, temp_block_index, BLOCK_SIZE);
-            
-            memcpy(buffer_pointer, block_buffer + data_offset, remaining_space_in_block);
-            
-            bytes_read              += remaining_space_in_block;
-            buffer_pointer          += remaining_space_in_block;
-            file_copy->data_pointer += remaining_space_in_block;
-            
-            data_index        = file_copy->data_pointer / BLOCK_SIZE;
-            data_offset       = file_copy->data_pointer % BLOCK_SIZE;
-            
-        }
-        
+    u32 run_start = 0;
+    u32 run_num   = 0;
+    
+    if(count > SFS_CACHE_BLOCKS / 2) {
+        count = SFS_CACHE_BLOCKS / 2;
     }
     
+    pthread_mutex_lock(&fs->cache_lock);
     
-    for(u32 i = 0; i < blocks_num; i++) {
+    for(u32 i = 0; i <= count; i++) {
         
-        //find the block which data pointer points to
-        //in direct blocks
-        if(data_index < 5) {
-            
-            temp_block_index = file_copy->node.direct[data_index] / BLOCK_SIZE;
+        if(i < count && cache_lookup(fs, first_block + i) == NULL) {
             
-        //indirect blocks
-        } else {
+            if(run_num == 0) {
+                run_start = first_block + i;
+            }
             
-            read_block(block_buffer, file_copy->node.indirect / BLOCK_SIZE, BLOCK_SIZE);
+            iov[run_num].iov_base = cache_insert(fs, first_block + i)->data;
+            iov[run_num].iov_len  = FS_BLOCK_SIZE;
             
-            temp_block_index = *(u32*)(block_buffer + (data_index - 5) * sizeof(u32)) / BLOCK_SIZE;
+            run_num++;
             
+            continue;
         }
         
-        //read the block
-        read_block(block_buffer, temp_block_index, BLOCK_SIZE);
-        
-        //ending block
-        if(i == blocks_num - 1) {
+        if(run_num != 0) {
             
-            //if data is block aligned
-            if(reminder == 0) {
-                
-                bytes_read              += read_block(buffer_pointer, temp_block_index, BLOCK_SIZE);
-                file_copy->data_pointer += BLOCK_SIZE;
+            //blocks of a failed read are loaded again when they are used
+            if(disk_readv(fs, iov, run_num, (u64)run_start * FS_BLOCK_SIZE) != run_num * FS_BLOCK_SIZE) {
                 
-                //if not
-            } else {
-                
-                bytes_read              += read_block(buffer_pointer, temp_block_index, reminder);
-                file_copy->data_pointer += reminder;
+                for(u32 j = 0; j < run_num; j++) {
+                    cache_invalidate(fs, ((char*)iov[j].iov_base - fs->cache_memory) / FS_BLOCK_SIZE);
+                }
             }
             
-            //this whole shit could be done like:
-            //bytes_read              += read_block(buffer_pointer, temp_block_index, (reminder == 0) ? BLOCK_SIZE : reminder);
-            //file_copy->data_pointer += (reminder == 0) ? BLOCK_SIZE : reminder;
-            
-        //middle block
-        } else {
-            
-            bytes_read              += read_block(block_buffer, temp_block_index, BLOCK_SIZE);
-            
-            buffer_pointer          += BLOCK_SIZE;
-            file_copy->data_pointer += BLOCK_SIZE;
+            STAT_COUNT(fs->cache_counters.readahead, run_num);
             
+            run_num = 0;
         }
-        
-        data_index = file_copy->data_pointer / BLOCK_SIZE;
     }
     
-    //flush the file
-    fseek(sfs.disk, BLOCK_SIZE + file->inumber * sizeof(inode), SEEK_SET);
-    
-    fwrite((char*)&file_copy->node, sizeof(inode), 1, sfs.disk);
-    
-    memcpy(file, file_copy, sizeof(sfs_file));
-    
-    free(file_copy);
-    free(block_buffer);
-
-    return bytes_read;
+    pthread_mutex_unlock(&fs->cache_lock);
 }
 
-//write file
-u32  sfs_write_file(void* buffer, u32 size, sfs_file* file) {
+static void cache_destroy(SFS* fs) {
     
-    if(size == 0) { return 0; }
-
-    //note: no cotrol of overflow
-    if(size + file->node.size > MAX_FILE_SIZE) {
-        SFS_ZERO_ERROR("sfs_write_file error: size of data is too big\n");
-    }
-
-    //create backup
-    sfs_file* file_copy = malloc(sizeof(sfs_file));
-    memcpy(file_copy, file, sizeof(sfs_file));
+    free(fs->cache_memory);
+    fs->cache_memory = NULL;
+}
 
-    //create necessary variables
-    u32 data_index        = file_copy->node.size / BLOCK_SIZE;
-    u32 data_offset       = file_copy->node.size % BLOCK_SIZE;
+//write back cached copies of blocks in range so the disk can be read directly
+static void cache_sync_range(SFS* fs, u32 first_block, u32 count) {
     
-    u32 remaining_space_in_last_block = (data_offset == 0) ? 0 : BLOCK_SIZE - data_offset;
+    pthread_mutex_lock(&fs->cache_lock);
     
-    u32 blocks_num        = floor(((double)size - (double)remaining_space_in_last_block - 1.0) / (double)BLOCK_SIZE + 1.0);
+    for(u32 i = 0; i < SFS_CACHE_BLOCKS; i++) {
+        
+        if(fs->cache[i].valid && fs->cache[i].block_index - first_block < count) {
+            cache_writeback(fs, &fs->cache[i]);
+        }
+    }
     
-    u32 reminder          = (size - remaining_space_in_last_block) % BLOCK_SIZE;
-    u32 bytes_written     = 0;
+    pthread_mutex_unlock(&fs->cache_lock);
+}
+
+//drop cached copies of blocks in range after the disk was written directly
+static void cache_drop_range(SFS* fs, u32 first_block, u32 count) {
     
-    u32* blocks_array     = calloc(blocks_num, sizeof(u32));
-    char* block_buffer    = malloc(BLOCK_SIZE);
-    char* buffer_pointer  = buffer;
+    pthread_mutex_lock(&fs->cache_lock);
     
-    //scan for free blocks
-    for(u32 i = 0; i < blocks_num; i++) {
-        
-        blocks_array[i] = get_free_node();
+    for(u32 i = 0; i < SFS_CACHE_BLOCKS; i++) {
         
-        if(blocks_array[i] == SFS_NULL) {
-            free(file_copy);
-            free(blocks_array);
-            free(block_buffer);
-            SFS_ZERO_ERROR("sfs_write_file error: out of physical memory\n");
+        if(fs->cache[i].valid && fs->cache[i].block_index - first_block < count) {
+            cache_invalidate(fs, i);
         }
-     
     }
     
-    //if there is space in the last block fill it
-    //this will not run when the file is empty
-    if(remaining_space_in_last_block != 0) {
+    pthread_mutex_unlock(&fs->cache_lock);
+}
+
+//copies part of the block out of the mapped disk or the block cache, false if the block cannot be read
+static bool copy_from_block(SFS* fs, u32 block_index, u32 offset, void* buffer, u32 bytes) {
+    
+    STAT_ADD(fs->op_counters.bytes_copied, bytes);
+    
+    if(fs->io_mode == SFS_IO_MMAP) {
+        memcpy(buffer, fs->map + (u64)block_index * FS_BLOCK_SIZE + offset, bytes);
+        STAT_ADD(fs->op_counters.blocks_read, 1);
+        return true;
+    }
+    
+    pthread_mutex_lock(&fs->cache_lock);
+    
+    cache_block* entry = cache_get(fs, block_index, true);
+    
+    if(entry != NULL) {
+        memcpy(buffer, entry->data + offset, bytes);
+    }
+    
+    pthread_mutex_unlock(&fs->cache_lock);
+    
+    return entry != NULL;
+}
+
+//copies data into part of the block in the mapped disk or the block cache
+//false if the rest of the block cannot be read
+static bool copy_to_block(SFS* fs, u32 block_index, u32 offset, void* buffer, u32 bytes) {
+    
+    STAT_ADD(fs->op_counters.bytes_copied, bytes);
+    
+    if(fs->io_mode == SFS_IO_MMAP) {
+        memcpy(fs->map + (u64)block_index * FS_BLOCK_SIZE + offset, buffer, bytes);
+        STAT_ADD(fs->op_counters.blocks_written, 1);
+        return true;
+    }
+    
+    pthread_mutex_lock(&fs->cache_lock);
+    
+    //whole block is overwritten, no need to load it first
+    cache_block* entry = cache_get(fs, block_index, offset != 0 || bytes != FS_BLOCK_SIZE);
+    
+    if(entry != NULL) {
         
-        u32 single_block_index;
+        memcpy(entry->data + offset, buffer, bytes);
         
-        //find the last block
-        //in direct blocks
-        if(data_index < 5) {
+        entry->dirty = 1;
+    }
     
-            single_block_index = file_copy->node.direct[data_index] / BLOCK_SIZE;
-            
-        //indirect blocks
-        } else {
-            
-            read_block(block_buffer, file_copy->node.indirect / BLOCK_SIZE, BLOCK_SIZE);
-            
-            single_block_index = *(u32*)(block_buffer + (data_index - 5) * sizeof(u32)) / BLOCK_SIZE;
-            
+    pthread_mutex_unlock(&fs->cache_lock);
+    
+    return entry != NULL;
+}
+
+//true if range of bytes starting offset bytes into a block contains at least one whole block
+static bool covers_whole_block(SFS* fs, u32 offset, u32 bytes) {
+    
+    u64 first_whole = ((u64)offset + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+    u64 end         = ((u64)offset + bytes) / FS_BLOCK_SIZE;
+    
+    return end > first_whole;
+}
+
+//reads bytes starting offset bytes into first_block block by block through the block cache
+static u32 read_cached(SFS* fs, void* buffer, u32 first_block, u32 offset, u32 bytes) {
+    
+    for(u32 done = 0, piece; done < bytes; done += piece) {
+        
+        u32 block_offset = (offset + done) % FS_BLOCK_SIZE;
+        
+        piece = (bytes - done < FS_BLOCK_SIZE - block_offset) ? bytes - done : FS_BLOCK_SIZE - block_offset;
+        
+        if(!copy_from_block(fs, first_block + (offset + done) / FS_BLOCK_SIZE, block_offset, (char*)buffer + done, piece)) {
+            return done;
         }
+    }
+    
+    return bytes;
+}
+
+//starts loading blocks that are going to be read soon
+static void prefetch_range(SFS* fs, u32 first_block, u32 count) {
+    
+    if(fs->io_mode == SFS_IO_MMAP) {
+        madvise(fs->map + (u64)first_block * FS_BLOCK_SIZE, (u64)count * FS_BLOCK_SIZE, MADV_WILLNEED);
+    } else {
+        cache_prefetch(fs, first_block, count);
+    }
+}
+
+//reads bytes starting offset bytes into first_block straight into the buffer
+//the range may span many contiguous blocks, it is read with one I/O
+static u32 read_range(SFS* fs, void* buffer, u32 first_block, u32 offset, u32 bytes) {
+    
+    u64 start = (u64)first_block * FS_BLOCK_SIZE + offset;
+    
+    if(start + bytes > (u64)fs->blocks * FS_BLOCK_SIZE) {
+        SFS_ZERO_ERROR(SFS_EINVAL, "read_range error: block index out of range");
+    }
+    
+    if(fs->io_mode == SFS_IO_MMAP) {
         
+        memcpy(buffer, fs->map + start, bytes);
         
+        STAT_ADD(fs->io_counters.bytes_read, bytes);
+        STAT_ADD(fs->op_counters.bytes_copied, bytes);
+        STAT_ADD(fs->op_counters.blocks_read, map_range(fs, offset, bytes).count);
         
-        //if the data will fit into that remaining space
-        if(blocks_num == 0) {
-            
-            read_block(block_buffer, single_block_index, BLOCK_SIZE);
-            
-            memcpy(block_buffer + data_offset, buffer_pointer, size);
-            
-            bytes_written        += write_block(block_buffer, single_block_index, BLOCK_SIZE);
-            file_copy->node.size += size;
-            
-            //we are done, nope :/ actually probably yes
-            
-        //we write the that remaining data and the proceed onto the next blocks
-        } else {
-            
-            read_block(block_buffer, single_block_index, BLOCK_SIZE);
-            
-            memcpy(block_buffer + data_offset, buffer_pointer, remaining_space_in_last_block);
-            
-            bytes_written        += write_block(block_buffer, single_block_index, BLOCK_SIZE);
+        return bytes;
+    }
+    
+    //ranges without a whole block are served block by block from the block cache
+    if(!covers_whole_block(fs, offset, bytes)) {
+        return read_cached(fs, buffer, first_block, offset, bytes);
+    }
+    
+    //newer data may still be in the cache
+    cache_sync_range(fs, first_block, ((u64)offset + bytes + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE);
+    
+    struct iovec iov = { buffer, bytes };
+    
+    return disk_readv(fs, &iov, 1, start);
+}
+
+//writes bytes starting offset bytes into first_block straight from the buffer
+//the range may span many contiguous blocks, it is written with one I/O
+static u32 write_range(SFS* fs, void* buffer, u32 first_block, u32 offset, u32 bytes) {
+    
+    u64 start  = (u64)first_block * FS_BLOCK_SIZE + offset;
+    u32 blocks = ((u64)offset + bytes + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+    
+    if(start + bytes > (u64)fs->blocks * FS_BLOCK_SIZE) {
+        SFS_ZERO_ERROR(SFS_EINVAL, "write_range error: block index out of range");
+    }
+    
+    if(fs->io_mode == SFS_IO_MMAP) {
+        
+        memcpy(fs->map + start, buffer, bytes);
+        
+        STAT_ADD(fs->io_counters.bytes_written, bytes);
+        STAT_ADD(fs->op_counters.bytes_copied, bytes);
+        STAT_ADD(fs->op_counters.blocks_written, map_range(fs, offset, bytes).count);
+        
+        return bytes;
+    }
+    
+    //ranges without a whole block are absorbed block by block by the block cache
+    if(!covers_whole_block(fs, offset, bytes)) {
+        
+        for(u32 done = 0, piece; done < bytes; done += piece) {
             
-            buffer_pointer       += remaining_space_in_last_block;
-            file_copy->node.size += remaining_space_in_last_block;
+            u32 block_offset = (offset + done) % FS_BLOCK_SIZE;
             
-            data_index            = file_copy->node.size / BLOCK_SIZE;
-            data_offset           = file_copy->node.size % BLOCK_SIZE;
+            piece = (bytes - done < FS_BLOCK_SIZE - block_offset) ? bytes - done : FS_BLOCK_SIZE - block_offset;
             
+            if(!copy_to_block(fs, first_block + (offset + done) / FS_BLOCK_SIZE, block_offset, (char*)buffer + done, piece)) {
+                return done;
+            }
         }
+        
+        return bytes;
     }
+    
+    //partially overwritten cached blocks go to disk first, then they are stale
+    cache_sync_range(fs, first_block, blocks);
+    
+    struct iovec iov = { buffer, bytes };
+    
+    u32 written = disk_writev(fs, &iov, 1, start);
+    
+    cache_drop_range(fs, first_block, blocks);
+    
+    return written;
+}
 
-    //write the rest of the blocks
-    //we are starting at the beggining of the block
-    //be aware of the ending block
-    //be aware of the direct and indirect pointers
+/*INODE TABLE CACHE*/
+
+//returns inode block, loads it with one read on first use, inode table lock must be held
+//NULL if it cannot be loaded, a page with wrong data would be committed over the inodes
+static inode* inode_page(SFS* fs, u32 page) {
     
-    for(u32 i = 0; i < blocks_num; i++) {
+    if(fs->inode_pages[page] == NULL) {
         
-        //scan inode for direct free block pointers
-        //and set it to the current block
-        bool found_direct = false;
+        inode* loaded = fs_malloc(fs, FS_BLOCK_SIZE);
         
+        if(loaded == NULL) { SFS_NULL_ERROR(SFS_ENOMEM, "sfs inode error: out of memory"); }
         
-        for(u32 j = 0; j < 5; j++) {
-            
-            if(file_copy->node.direct[j] == SFS_NULL) {
-                
-                file_copy->node.direct[j] = blocks_array[i] * BLOCK_SIZE;
-                
-                found_direct = true;
-                break;
-            }
+        if(read_range(fs, loaded, 1 + page, 0, FS_BLOCK_SIZE) != FS_BLOCK_SIZE) {
+            free(loaded);
+            SFS_NULL_ERROR(SFS_EIO, "sfs inode error: inode block cannot be read");
         }
         
-        //if not found scan for indirect free block pointers
-        //if indirect block doesn't exist create it
-        if(!found_direct) {
-            
-            if(file_copy->node.indirect == SFS_NULL) {
-                
-                file_copy->node.indirect = get_free_node() * BLOCK_SIZE;
-                
-                if(file_copy->node.indirect == SFS_NULL) {
-                    
-                    free(file_copy);
-                    free(blocks_array);
-                    free(block_buffer);
-                    SFS_ZERO_ERROR("sfs_write_file error: indirect block cannot be allocated, out of memory\n");
-                }
-                
-                //fill it with zeros
-                memset(block_buffer, 0, BLOCK_SIZE);
-                
-                write_block(block_buffer, file_copy->node.indirect / BLOCK_SIZE, BLOCK_SIZE);
-            }
-            
-            //scanning
-            read_block(block_buffer, file_copy->node.indirect / BLOCK_SIZE, BLOCK_SIZE);
+        //list doubles whenever its size reaches a power of two
+        if((fs->inode_loaded_num & (fs->inode_loaded_num - 1)) == 0) {
             
-            bool found_indirect = false;
+            u32* list = fs_realloc(fs, fs->inode_loaded, (fs->inode_loaded_num ? fs->inode_loaded_num * 2 : 1) * sizeof(u32));
             
-            for(u32 j = 0; j < BLOCK_SIZE; j += sizeof(u32)) {
-                
-                u32* p = (u32*)(block_buffer + j);
-                
-                //we found indirect pointer
-                if(*p == SFS_NULL) {
-                    
-                    *p = blocks_array[i] * BLOCK_SIZE;
-                    
-                    write_block(block_buffer, file_copy->node.indirect / BLOCK_SIZE, BLOCK_SIZE);
-                    
-                }
-                
+            if(list == NULL) {
+                free(loaded);
+                SFS_NULL_ERROR(SFS_ENOMEM, "sfs inode error: out of memory");
             }
             
-            if(!found_indirect)
-            {
-                free(file_copy);
-                free(blocks_array);
-                free(block_buffer);
-                SFS_ZERO_ERROR("sfs_write_file error: free indirect block pointer was not found, out of memory\n");
-            }
+            fs->inode_loaded = list;
         }
         
-        //ending block
-        if(i == blocks_num - 1) {
-            
-            //if data is block aligned
-            if(reminder == 0) {
+        fs->inode_pages[page] = loaded;
+        fs->inode_loaded[fs->inode_loaded_num++] = page;
+    }
+    
+    return fs->inode_pages[page];
+}
 
-                bytes_written        += write_block(buffer_pointer, blocks_array[i], BLOCK_SIZE);
-                file_copy->node.size += BLOCK_SIZE;
-                
-             //if not
-            } else {
-            
-                bytes_written        += write_block(buffer_pointer, blocks_array[i], reminder);
-                file_copy->node.size += reminder;
-            }
-            
-        //middle whole block
-        } else {
-            
-            bytes_written        += write_block(buffer_pointer, blocks_array[i], BLOCK_SIZE);
-            
-            buffer_pointer       += BLOCK_SIZE;
-            file_copy->node.size += BLOCK_SIZE;
-            
-        }
+//marks inode block as modified, inode table lock must be held
+static void mark_inode_page(SFS* fs, u32 page) {
+    
+    u64* word = &fs->inode_dirty[page / BITMAP_WORD_BITS];
+    
+    if(!GET_BIT64(*word, page % BITMAP_WORD_BITS)) {
+        SET_BIT64(*word, page % BITMAP_WORD_BITS, 1);
+        fs->inode_dirty_num++;
+    }
+}
+
+//read inode from inode table, false if its block cannot be loaded, the node reads as unused then
+static bool read_inode(SFS* fs, u32 index, inode* node) {
+    
+    STAT_ADD(fs->op_counters.inode_reads, 1);
+    
+    pthread_mutex_lock(&fs->inode_table_lock);
+    
+    inode* page = inode_page(fs, index / INODES_PER_BLOCK);
+    
+    if(page != NULL) {
+        *node = page[index % INODES_PER_BLOCK];
+    } else {
+        memset(node, 0, sizeof(inode));
+    }
+    
+    pthread_mutex_unlock(&fs->inode_table_lock);
+    
+    return page != NULL;
+}
+
+//write inode to inode table, it reaches the disk with the next journal commit
+//false if its block cannot be loaded
+static bool write_inode(SFS* fs, u32 index, inode* node) {
+    
+    u32 page = index / INODES_PER_BLOCK;
+    
+    STAT_ADD(fs->op_counters.inode_writes, 1);
+    
+    pthread_mutex_lock(&fs->inode_table_lock);
+    
+    inode* nodes = inode_page(fs, page);
+    
+    if(nodes != NULL) {
         
-        data_index = file_copy->node.size / BLOCK_SIZE;
+        nodes[index % INODES_PER_BLOCK] = *node;
         
-        SET_BIT(g_free_block_bitmap[(blocks_array[i] / BLOCK_SIZE) / 8], (blocks_array[i] / BLOCK_SIZE) % 8, 1);
+        mark_inode_page(fs, page);
     }
     
-    //flush the file
-    fseek(sfs.disk, BLOCK_SIZE + file->inumber * sizeof(inode), SEEK_SET);
+    pthread_mutex_unlock(&fs->inode_table_lock);
     
-    fwrite((char*)&file_copy->node, sizeof(inode), 1, sfs.disk);
+    return nodes != NULL;
+}
+
+/*FREE BLOCK BITMAP*/
+
+//returns bitmap word holding the bit of the block, its bitmap block is read on first use, allocator lock must be held
+static u64* bitmap_word(SFS* fs, u32 block_index) {
     
-    memcpy(file, file_copy, sizeof(sfs_file));
+    u32 page = block_index / BITMAP_BLOCK_BITS;
     
-    free(file_copy);
-    free(blocks_array);
-    free(block_buffer);
+    if(!GET_BIT64(fs->bitmap_loaded[page / BITMAP_WORD_BITS], page % BITMAP_WORD_BITS)) {
+        
+        u64 start = (u64)page * FS_BLOCK_SIZE;
+        u64 end   = BITMAP_WORDS * sizeof(u64);
+        
+        read_range(fs, (char*)fs->free_block_bitmap + start, BITMAP_START + page, 0, (end - start < FS_BLOCK_SIZE) ? end - start : FS_BLOCK_SIZE);
+        
+        SET_BIT64(fs->bitmap_loaded[page / BITMAP_WORD_BITS], page % BITMAP_WORD_BITS, 1);
+    }
     
-    return bytes_written;
+    return &fs->free_block_bitmap[block_index / BITMAP_WORD_BITS];
 }
 
-//delete inode
-void sfs_delet_file(u32 index) {
+//allocator lock must be held
+static void mark_block(SFS* fs, u32 block_index, bool used) {
+    
+    u32  page = block_index / BITMAP_BLOCK_BITS;
+    u64* word = bitmap_word(fs, block_index);
+    
+    SET_BIT64(*word, block_index % BITMAP_WORD_BITS, used);
+    SET_BIT64(fs->bitmap_dirty[page / BITMAP_WORD_BITS], page % BITMAP_WORD_BITS, 1);
+    
+    if(!used) {
+        SET_BIT64(fs->bitmap_full[page / BITMAP_WORD_BITS], page % BITMAP_WORD_BITS, 0);
+    }
+}
+
+/*METADATA JOURNAL*/
+
+//first journal block, images of the committed blocks follow it in the same order
+typedef struct journal_descriptor {
+    u32 magic;    //JOURNAL_MAGIC
+    u32 count;    //number of block images
+    u32 checksum; //FNV-1a of count, targets and images, torn journal writes do not match
+    u32 targets[];  //JOURNAL_MAX_BLOCKS of them fill the block
+} journal_descriptor;
+
+//blocks of the commit being assembled
+typedef struct journal_stage {
+    journal_descriptor* descriptor;
+    char*               images;
+    u32                 chunks; //parts of the commit already written, commit bigger than the journal is split
+    bool                failed; //a write failed, the rest of the commit is dropped
+} journal_stage;
 
-    if(index > sfs.inodes) {
-        SFS_ERROR("sfs_delet_file error: index out of bounds\n");
+//writes dirty cached blocks to disk, mapped disk is written back by the kernel
+static bool flush_data(SFS* fs) {
+    
+    bool written = true;
+    
+    if(fs->io_mode == SFS_IO_MMAP) { return true; }
+    
+    pthread_mutex_lock(&fs->cache_lock);
+    
+    for(u32 i = 0; i < SFS_CACHE_BLOCKS; i++) {
+        written &= cache_writeback(fs, &fs->cache[i]);
     }
+    
+    pthread_mutex_unlock(&fs->cache_lock);
+    
+    return written;
+}
 
-    //load the node
-    fseek(sfs.disk, BLOCK_SIZE + index * sizeof(inode), SEEK_SET);
+static u32 journal_checksum(SFS* fs, journal_descriptor* descriptor, char* images) {
     
-    inode node;
+    u32 hash = 2166136261U;
     
-    fread((char*)&node, sizeof(node), 1, sfs.disk);
+    u8* bytes = (u8*)&descriptor->count;
     
-    //if node is not active ignore everything
-    if(!node.valid) { return; }
+    for(u32 i = 0; i < sizeof(u32); i++) {
+        hash = (hash ^ bytes[i]) * 16777619U;
+    }
     
-    //scan the pointers and deallocate them
-    //direct
-    for(u8 i = 0; i < 5; i++) {
-        //deallocate the block
-        if(node.direct[i] != SFS_NULL) {
-            
-            SET_BIT(g_free_block_bitmap[(node.direct[i] / BLOCK_SIZE) / 8], (node.direct[i] / BLOCK_SIZE) % 8, 0);
+    bytes = (u8*)descriptor->targets;
+    
+    for(u32 i = 0; i < descriptor->count * sizeof(u32); i++) {
+        hash = (hash ^ bytes[i]) * 16777619U;
+    }
+    
+    for(u64 i = 0; i < (u64)descriptor->count * FS_BLOCK_SIZE; i++) {
+        hash = (hash ^ (u8)images[i]) * 16777619U;
+    }
+    
+    return hash;
+}
+
+//writes block images to their places, runs of consecutive targets are written with one I/O
+static bool write_images(SFS* fs, u32* targets, char* images, u32 count) {
+    
+    for(u32 i = 0, run; i < count; i += run) {
+        
+        for(run = 1; i + run < count && targets[i + run] == targets[i] + run; run++);
+        
+        if(write_range(fs, images + (u64)i * FS_BLOCK_SIZE, targets[i], 0, run * FS_BLOCK_SIZE) != run * FS_BLOCK_SIZE) {
+            disk_failed(fs);
+            return false;
         }
     }
     
-    //indirect
-    if(node.indirect != SFS_NULL) {
+    return true;
+}
+
+//writes staged blocks to the journal and then to their places
+//after a failed write nothing more is written, blocks not past their commit point stay as they were
+static void journal_write(SFS* fs, journal_stage* stage) {
+    
+    journal_descriptor* descriptor = stage->descriptor;
+    
+    if(descriptor->count == 0) { return; }
+    
+    //previous part must be in place before its journal copy is overwritten
+    bool written = !stage->failed && (stage->chunks == 0 || disk_barrier(fs));
+    
+    if(written) {
+        
+        descriptor->magic    = JOURNAL_MAGIC;
+        descriptor->checksum = journal_checksum(fs, descriptor, stage->images);
         
-        char* block_buffer = malloc(BLOCK_SIZE);
-        u32   block_pointer;
+        //images follow the descriptor in memory as on disk, torn writes are caught by the checksum
+        u32 bytes = (1 + descriptor->count) * FS_BLOCK_SIZE;
         
-        read_block(block_buffer, node.indirect / BLOCK_SIZE, BLOCK_SIZE);
+        written = write_range(fs, descriptor, JOURNAL_START, 0, bytes) == bytes;
+        
+        if(!written) {
+            disk_failed(fs);
+        }
+    }
+    
+    //commit point, from now on the blocks are replayed after a crash
+    written = written && disk_barrier(fs) && write_images(fs, descriptor->targets, stage->images, descriptor->count);
+    
+    stage->failed = !written;
+    
+    descriptor->count = 0;
+    stage->chunks++;
+}
+
+//adds block image to the commit, bytes past size are zero
+static void journal_stage_block(SFS* fs, journal_stage* stage, u32 target, void* image, u32 size) {
+    
+    journal_descriptor* descriptor = stage->descriptor;
+    
+    char* slot = stage->images + (u64)descriptor->count * FS_BLOCK_SIZE;
+    
+    memcpy(slot, image, size);
+    memset(slot + size, 0, FS_BLOCK_SIZE - size);
+    
+    descriptor->targets[descriptor->count++] = target;
+    
+    if(descriptor->count == JOURNAL_CAPACITY) {
+        journal_write(fs, stage);
+    }
+}
+
+//makes all updates done so far durable, file data are written before the metadata pointing to them
+//bitmap, inode and extent blocks changed since the last commit go through the journal together
+//SFS_EIO if this or any earlier write of the disk failed, metadata of data that failed to be written is not committed
+static sfs_status journal_commit(SFS* fs) {
+    
+    pthread_rwlock_wrlock(&fs->journal_lock);
+    
+    bool flushed = flush_data(fs);
+    
+    flushed = disk_barrier(fs) && flushed;
+    
+    //descriptor followed by block images, kept for the next commits
+    if(fs->journal_buffer == NULL) {
+        fs->journal_buffer = fs_calloc(fs, 1 + JOURNAL_CAPACITY, FS_BLOCK_SIZE);
+    }
+    
+    if(fs->journal_buffer == NULL) {
+        pthread_rwlock_unlock(&fs->journal_lock);
+        SFS_ERROR(SFS_ENOMEM, "journal_commit error: out of memory");
+    }
+    
+    journal_stage stage = { (journal_descriptor*)fs->journal_buffer, fs->journal_buffer + FS_BLOCK_SIZE, 0, !flushed };
+    
+    pthread_mutex_lock(&fs->alloc_lock);
+    
+    //freed blocks are not referenced by committed metadata any more once this commit is done
+    //only parts of the bitmap with pending frees are visited
+    for(u32 w = 0; fs->pending_free_num != 0 && w < BITMAP_DIRTY_WORDS; w++) {
         
-        //scan the indirect block
-        for(u32 i = 0; i < BLOCK_SIZE; i += sizeof(u32)) {
+        for(u64 touched = fs->pending_dirty[w]; touched != 0; touched &= touched - 1) {
             
-            block_pointer = *(u32*)&block_buffer[i];
+            u32 page  = w * BITMAP_WORD_BITS + __builtin_ctzll(touched);
+            u32 first = page * BITMAP_BLOCK_WORDS;
+            u32 end   = (first + BITMAP_BLOCK_WORDS < BITMAP_WORDS) ? first + BITMAP_BLOCK_WORDS : BITMAP_WORDS;
             
-            //deallocate the block
-            if(block_pointer != SFS_NULL) {
+            for(u32 word = first; word < end; word++) {
                 
-                SET_BIT(g_free_block_bitmap[(block_pointer / BLOCK_SIZE) / 8], (block_pointer / BLOCK_SIZE) % 8, 0);
+                for(u64 freed = fs->pending_free[word]; freed != 0; freed &= freed - 1) {
+                    MARK_BLOCK(word * BITMAP_WORD_BITS + __builtin_ctzll(freed), 0);
+                }
+                
+                fs->pending_free[word] = 0;
             }
         }
         
-        SET_BIT(g_free_block_bitmap[(node.indirect / BLOCK_SIZE) / 8], (node.indirect / BLOCK_SIZE) % 8, 0);
+        fs->pending_dirty[w] = 0;
+    }
+    
+    fs->pending_free_num = 0;
+    
+    for(u32 w = 0; w < BITMAP_DIRTY_WORDS; w++) {
         
-        free(block_buffer);
+        for(u64 dirty = fs->bitmap_dirty[w]; dirty != 0; dirty &= dirty - 1) {
+            
+            u32 block = w * BITMAP_WORD_BITS + __builtin_ctzll(dirty);
+            u64 start = (u64)block * FS_BLOCK_SIZE;
+            u64 end   = BITMAP_WORDS * sizeof(u64);
+            
+            journal_stage_block(fs, &stage, BITMAP_START + block, (char*)fs->free_block_bitmap + start, (end - start < FS_BLOCK_SIZE) ? end - start : FS_BLOCK_SIZE);
+        }
         
+        fs->bitmap_dirty[w] = 0;
     }
-
-    char delet_this = 0;
-
-    fwrite((char*)&delet_this, sizeof(char), 1, sfs.disk);
-}
-
-//returns file size
-u32  sfs_file_size (sfs_file* file) {
-    return file->node.size;
-}
-
-//set file data pointer
-void sfs_file_seek (sfs_file* file, u32 offset) {
-    file->data_pointer = offset;
-}
-
-//read file data pointer
-u32 sfs_file_tell (sfs_file* file) {
-    return file->data_pointer;
+    
+    pthread_mutex_unlock(&fs->alloc_lock);
+    
+    pthread_mutex_lock(&fs->inode_table_lock);
+    
+    for(u32 w = 0; fs->inode_dirty_num != 0 && w < INODE_PAGE_WORDS; w++) {
+        
+        for(u64 dirty = fs->inode_dirty[w]; dirty != 0; dirty &= dirty - 1) {
+            
+            u32 page = w * BITMAP_WORD_BITS + __builtin_ctzll(dirty);
+            
+            journal_stage_block(fs, &stage, 1 + page, fs->inode_pages[page], FS_BLOCK_SIZE);
+        }
+        
+        fs->inode_dirty[w] = 0;
+    }
+    
+    fs->inode_dirty_num = 0;
+    
+    pthread_mutex_unlock(&fs->inode_table_lock);
+    
+    pthread_mutex_lock(&fs->journal_mutex);
+    
+    for(u32 i = 0; i < fs->journal_num; i++) {
+        journal_stage_block(fs, &stage, fs->journal_targets[i], fs->journal_images + (u64)i * FS_BLOCK_SIZE, FS_BLOCK_SIZE);
+    }
+    
+    journal_write(fs, &stage);
+    
+    //blocks are in place, reads go to the disk again
+    fs->journal_num = 0;
+    
+    pthread_mutex_unlock(&fs->journal_mutex);
+    
+    pthread_rwlock_unlock(&fs->journal_lock);
+    
+    if(__atomic_load_n(&fs->io_failed, __ATOMIC_RELAXED)) {
+        SFS_ERROR(SFS_EIO, "journal_commit error: disk lost writes, last commits may be missing");
+    }
+    
+    return SFS_OK;
 }
 
+//writes blocks of the last commit to their places again, the commit may not have reached them before a crash
+//returns number of replayed blocks
+static u32 journal_replay(SFS* fs) {
+    
+    journal_descriptor* descriptor = malloc(FS_BLOCK_SIZE);
+    
+    read_range(fs, descriptor, JOURNAL_START, 0, FS_BLOCK_SIZE);
+    
+    u32 count = 0;
+    
+    if(descriptor->magic == JOURNAL_MAGIC && descriptor->count != 0 && descriptor->count <= JOURNAL_CAPACITY) {
+        
+        char* images = malloc((u64)descriptor->count * FS_BLOCK_SIZE);
+        
+        read_range(fs, images, JOURNAL_START + 1, 0, descriptor->count * FS_BLOCK_SIZE);
+        
+        bool valid = journal_checksum(fs, descriptor, images) == descriptor->checksum;
+        
+        for(u32 i = 0; valid && i < descriptor->count; i++) {
+            valid = descriptor->targets[i] != 0 && descriptor->targets[i] < fs->blocks;
+        }
+        
+        //torn commit never reached the commit point, nothing of it is in place
+        if(valid) {
+            
+            write_images(fs, descriptor->targets, images, descriptor->count);
+            
+            disk_barrier(fs);
+            
+            count = descriptor->count;
+        }
+        
+        free(images);
+    }
+    
+    free(descriptor);
+    
+    return count;
+}
+
+//adds block written by metadata update to the next commit, replaces its older image
+//false if the journal cannot grow, images added so far stay, the commit cannot run under the journal lock
+static bool journal_add(SFS* fs, u32 block_index, void* image) {
+    
+    pthread_mutex_lock(&fs->journal_mutex);
+    
+    u32 i = 0;
+    
+    while(i < fs->journal_num && fs->journal_targets[i] != block_index) { i++; }
+    
+    if(i == fs->journal_capacity) {
+        
+        u32 capacity = (fs->journal_capacity == 0) ? 16 : fs->journal_capacity * 2;
+        
+        u32* targets = fs_realloc(fs, fs->journal_targets, capacity * sizeof(u32));
+        
+        if(targets != NULL) {
+            fs->journal_targets = targets;
+        }
+        
+        char* images = (targets != NULL) ? fs_realloc(fs, fs->journal_images, (u64)capacity * FS_BLOCK_SIZE) : NULL;
+        
+        if(images == NULL) {
+            pthread_mutex_unlock(&fs->journal_mutex);
+            SFS_ZERO_ERROR(SFS_ENOMEM, "journal_add error: out of memory");
+        }
+        
+        fs->journal_images   = images;
+        fs->journal_capacity = capacity;
+    }
+    
+    if(i == fs->journal_num) {
+        fs->journal_targets[fs->journal_num++] = block_index;
+    }
+    
+    memcpy(fs->journal_images + (u64)i * FS_BLOCK_SIZE, image, FS_BLOCK_SIZE);
+    
+    pthread_mutex_unlock(&fs->journal_mutex);
+    
+    return true;
+}
+
+//reads part of metadata block, image waiting for the next commit is newer than the disk
+//false if the block cannot be read, the buffer is zeroed then
+static bool read_metadata(SFS* fs, u32 block_index, u32 offset, void* buffer, u32 bytes) {
+    
+    pthread_mutex_lock(&fs->journal_mutex);
+    
+    for(u32 i = fs->journal_num; i-- > 0;) {
+        
+        if(fs->journal_targets[i] == block_index) {
+            
+            memcpy(buffer, fs->journal_images + (u64)i * FS_BLOCK_SIZE + offset, bytes);
+            
+            pthread_mutex_unlock(&fs->journal_mutex);
+            
+            return true;
+        }
+    }
+    
+    pthread_mutex_unlock(&fs->journal_mutex);
+    
+    if(!copy_from_block(fs, block_index, offset, buffer, bytes)) {
+        memset(buffer, 0, bytes);
+        return false;
+    }
+    
+    return true;
+}
+
+//true when the next commit should not wait any longer
+static bool journal_full(SFS* fs) {
+    
+    u32  load  = 0;
+    bool frees = false;
+    
+    pthread_mutex_lock(&fs->alloc_lock);
+    
+    for(u32 w = 0; w < BITMAP_DIRTY_WORDS; w++) {
+        load += __builtin_popcountll(fs->bitmap_dirty[w]);
+    }
+    
+    //freed blocks cannot be reused before the commit
+    frees = fs->pending_free_num > (fs->blocks - DATA_START) / 8;
+    
+    pthread_mutex_unlock(&fs->alloc_lock);
+    
+    pthread_mutex_lock(&fs->inode_table_lock);
+    load += fs->inode_dirty_num;
+    pthread_mutex_unlock(&fs->inode_table_lock);
+    
+    pthread_mutex_lock(&fs->journal_mutex);
+    load += fs->journal_num;
+    pthread_mutex_unlock(&fs->journal_mutex);
+    
+    //operation may add more blocks before the commit starts
+    return frees || load * 2 >= JOURNAL_CAPACITY;
+}
+
+//every metadata update runs between journal_begin and journal_end, they do not nest
+static void journal_begin(SFS* fs) {
+    pthread_rwlock_rdlock(&fs->journal_lock);
+}
+
+//updates are grouped into one commit until the journal is half full or sync_sfs is called
+static void journal_end(SFS* fs) {
+    
+    pthread_rwlock_unlock(&fs->journal_lock);
+    
+    if(journal_full(fs)) {
+        journal_commit(fs);
+    }
+}
+
+//blocks freed since the last commit cannot be reused before it, commits them after an operation ran out of space
+//true if there were such blocks and the operation can be tried once more, journal lock must not be held
+static bool commit_frees(SFS* fs) {
+    
+    if(sfs_last_error() != SFS_ENOSPC) { return false; }
+    
+    pthread_mutex_lock(&fs->alloc_lock);
+    
+    bool pending = fs->pending_free_num != 0;
+    
+    pthread_mutex_unlock(&fs->alloc_lock);
+    
+    return pending && journal_commit(fs) == SFS_OK;
+}
+
+//number of extent blocks needed for extents_num extents
+static u32 extent_blocks_num(SFS* fs, u32 extents_num) {
+    return (extents_num <= INLINE_EXTENTS) ? 0 : (extents_num - INLINE_EXTENTS - 1) / EXTENTS_PER_BLOCK + 1;
+}
+
+//returns block following block_index in the extent chain, it is stored in the last slot
+static u32 next_extent_block(SFS* fs, u32 block_index) {
+    
+    extent link;
+    
+    read_metadata(fs, block_index, EXTENTS_PER_BLOCK * sizeof(extent), &link, sizeof(extent));
+    
+    return link.start;
+}
+
+//returns index of n-th block of the extent chain
+static u32 extent_block(SFS* fs, inode* node, u32 n) {
+    
+    u32 block_index = node->indirect;
+    
+    for(u32 i = 0; i < n; i++) {
+        block_index = next_extent_block(fs, block_index);
+    }
+    
+    return block_index;
+}
+
+//returns i-th extent of the node
+static extent get_extent(SFS* fs, inode* node, u32 i) {
+    
+    if(i < INLINE_EXTENTS) {
+        return node->direct[i];
+    }
+    
+    i -= INLINE_EXTENTS;
+    
+    extent result;
+    
+    read_metadata(fs, extent_block(fs, node, i / EXTENTS_PER_BLOCK), (i % EXTENTS_PER_BLOCK) * sizeof(extent), &result, sizeof(extent));
+    
+    return result;
+}
+
+//frees blocks of the extent chain starting with n-th one after the next commit, allocator lock must be held
+static void release_extent_blocks(SFS* fs, inode* node, u32 n) {
+    
+    u32 blocks_num = extent_blocks_num(fs, node->extents_num);
+    
+    if(n >= blocks_num) { return; }
+    
+    u32 block_index = extent_block(fs, node, n);
+    
+    for(u32 i = n; i < blocks_num; i++) {
+        
+        FREE_BLOCK(block_index);
+        
+        block_index = next_extent_block(fs, block_index);
+    }
+}
+
+//makes room for count more extents in the handle
+static bool grow_extents(sfs_file* file, u32 count) {
+    
+    if(file->node.extents_num + count <= file->extents_capacity) { return true; }
+    
+    u32 capacity = file->extents_capacity * 2;
+    
+    if(capacity < file->node.extents_num + count) {
+        capacity = file->node.extents_num + count;
+    }
+    
+    extent* extents       = fs_realloc(file->fs, file->extents, capacity * sizeof(extent));
+    
+    if(extents == NULL) { SFS_ZERO_ERROR(SFS_ENOMEM, "grow_extents error: out of memory"); }
+    
+    file->extents = extents;
+    
+    u32*    extent_starts = fs_realloc(file->fs, file->extent_starts, capacity * sizeof(u32));
+    
+    if(extent_starts == NULL) { SFS_ZERO_ERROR(SFS_ENOMEM, "grow_extents error: out of memory"); }
+    
+    file->extent_starts    = extent_starts;
+    file->extents_capacity = capacity;
+    
+    return true;
+}
+
+//makes room for count blocks in the chain array of the handle
+static bool grow_chain_array(sfs_file* file, u32 count) {
+    
+    if(count <= file->chain_capacity) { return true; }
+    
+    u32 capacity = (file->chain_capacity * 2 < count) ? count : file->chain_capacity * 2;
+    
+    u32* chain = fs_realloc(file->fs, file->chain, capacity * sizeof(u32));
+    
+    if(chain == NULL) { return false; }
+    
+    file->chain          = chain;
+    file->chain_capacity = capacity;
+    
+    return true;
+}
+
+//decodes all extents of the file into the handle, reads every extent block once
+static bool load_extents(sfs_file* file) {
+    
+    SFS* fs = file->fs;
+    
+    if(file->extents_loaded) { return true; }
+    
+    u32 extents_num = file->node.extents_num;
+    
+    //arrays of a reused handle usually have room already
+    if(!grow_extents(file, INLINE_EXTENTS) || !grow_chain_array(file, extent_blocks_num(fs, extents_num) + 1)) {
+        SFS_ZERO_ERROR(SFS_ENOMEM, "load_extents error: out of memory");
+    }
+    
+    file->chain_num     = extent_blocks_num(fs, extents_num);
+    file->first_dirty   = extents_num;
+    file->extents_dirty = 0;
+    
+    memcpy(file->extents, file->node.direct, ((extents_num < INLINE_EXTENTS) ? extents_num : INLINE_EXTENTS) * sizeof(extent));
+    
+    //copy extent blocks
+    u32 block_index = file->node.indirect;
+    
+    for(u32 i = 0; i < file->chain_num; i++) {
+        
+        u32 count = extents_num - INLINE_EXTENTS - i * EXTENTS_PER_BLOCK;
+        
+        if(count > EXTENTS_PER_BLOCK) {
+            count = EXTENTS_PER_BLOCK;
+        }
+        
+        if(!read_metadata(fs, block_index, 0, file->extents + INLINE_EXTENTS + i * EXTENTS_PER_BLOCK, count * sizeof(extent))) {
+            return false;
+        }
+        
+        file->chain[i] = block_index;
+        
+        block_index = next_extent_block(fs, block_index);
+    }
+    
+    for(u32 i = 0, file_block = 0; i < extents_num; i++) {
+        
+        file->extent_starts[i] = file_block;
+        
+        file_block += file->extents[i].length;
+    }
+    
+    file->extents_loaded = 1;
+    
+    return true;
+}
+
+//translates block of the file to block on disk, binary search over loaded extents
+//run - number of contiguous blocks starting at the returned one, 0 if the block is not allocated
+static u32 map_file_block(sfs_file* file, u32 file_block, u32* run) {
+    
+    u32 low  = 0;
+    u32 high = file->node.extents_num;
+    
+    //find last extent starting at or before file_block
+    while(low < high) {
+        
+        u32 middle = (low + high) / 2;
+        
+        if(file->extent_starts[middle] <= file_block) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    
+    if(low != 0) {
+        
+        u32 offset = file_block - file->extent_starts[low - 1];
+        
+        if(offset < file->extents[low - 1].length) {
+            
+            *run = file->extents[low - 1].length - offset;
+            
+            return file->extents[low - 1].start + offset;
+        }
+    }
+    
+    *run = 0;
+    
+    return SFS_NULL;
+}
+
+//adds block to the end of the file, merges it with the last extent when contiguous
+//room for the extent must be made with grow_extents
+static void append_extent(sfs_file* file, u32 block_index) {
+    
+    u32 last = file->node.extents_num - 1;
+    
+    if(file->node.extents_num != 0 && file->extents[last].start + file->extents[last].length == block_index) {
+        
+        file->extents[last].length++;
+        
+    } else {
+        
+        last = file->node.extents_num++;
+        
+        file->extents[last].start  = block_index;
+        file->extents[last].length = 1;
+        file->extent_starts[last]  = (last == 0) ? 0 : file->extent_starts[last - 1] + file->extents[last - 1].length;
+    }
+    
+    if(last < INLINE_EXTENTS) {
+        
+        file->node.direct[last] = file->extents[last];
+        
+    } else if(!file->extents_dirty || last < file->first_dirty) {
+        
+        file->first_dirty   = last;
+        file->extents_dirty = 1;
+    }
+}
+
+//adds blocks to the extent chain so it can hold all extents of the file
+static bool grow_chain(sfs_file* file) {
+    
+    SFS* fs = file->fs;
+    
+    u32 chain_num = extent_blocks_num(fs, file->node.extents_num);
+    
+    if(chain_num <= file->chain_num) { return true; }
+    
+    if(!grow_chain_array(file, chain_num)) { SFS_ZERO_ERROR(SFS_ENOMEM, "grow_chain error: out of memory"); }
+    
+    if(reserve_blocks(fs, file->chain + file->chain_num, chain_num - file->chain_num) == 0) {
+        SFS_ZERO_ERROR(SFS_ENOSPC, "grow_chain error: extent block cannot be allocated, out of memory");
+    }
+    
+    file->chain_num     = chain_num;
+    file->node.indirect = file->chain[0];
+    
+    return true;
+}
+
+//writes changed extent blocks of the file to the journal
+//false if the journal cannot take them, they stay dirty for the next flush
+static bool flush_extents(sfs_file* file) {
+    
+    SFS* fs = file->fs;
+    
+    if(!file->extents_dirty) { return true; }
+    
+    extent block[SFS_MAX_BLOCK_SIZE / sizeof(extent)];
+    
+    for(u32 i = (file->first_dirty - INLINE_EXTENTS) / EXTENTS_PER_BLOCK; i < file->chain_num; i++) {
+        
+        u32 count = file->node.extents_num - INLINE_EXTENTS - i * EXTENTS_PER_BLOCK;
+        
+        if(count > EXTENTS_PER_BLOCK) {
+            count = EXTENTS_PER_BLOCK;
+        }
+        
+        memcpy(block, file->extents + INLINE_EXTENTS + i * EXTENTS_PER_BLOCK, count * sizeof(extent));
+        memset(block + count, 0, (EXTENTS_PER_BLOCK + 1 - count) * sizeof(extent));
+        
+        //link the next block
+        block[EXTENTS_PER_BLOCK].start = (i + 1 < file->chain_num) ? file->chain[i + 1] : SFS_NULL;
+        
+        if(!journal_add(fs, file->chain[i], block)) { return false; }
+    }
+    
+    file->first_dirty   = file->node.extents_num;
+    file->extents_dirty = 0;
+    
+    return true;
+}
+
+/*DISK IMPLEMENTATION*/
+
+static void destroy_sfs(SFS* fs);
+static void async_shutdown(SFS* fs);
+static void free_handle(sfs_file* file);
+
+//allocates bitmap with header, inode and bitmap blocks marked
+static u64* new_bitmap(SFS* fs) {
+    
+    u64* bitmap = calloc(BITMAP_WORDS, sizeof(u64));
+    
+    memset(bitmap, 0xff, DATA_START / BITMAP_WORD_BITS * sizeof(u64));
+    
+    for(u32 i = DATA_START / BITMAP_WORD_BITS * BITMAP_WORD_BITS; i < DATA_START; i++)
+    {
+        SET_BIT64(bitmap[i / BITMAP_WORD_BITS], i % BITMAP_WORD_BITS, 1);
+    }
+    
+    //bits past the end of the disk are never handed out
+    for(u64 i = fs->blocks; i < (u64)BITMAP_WORDS * BITMAP_WORD_BITS; i++)
+    {
+        SET_BIT64(bitmap[i / BITMAP_WORD_BITS], i % BITMAP_WORD_BITS, 1);
+    }
+    
+    return bitmap;
+}
+
+//bitmap blocks are loaded by bitmap_word, pages of the array that are never touched take no memory
+static void init_bitmap(SFS* fs) {
+    
+    fs->free_block_bitmap = calloc(BITMAP_WORDS, sizeof(u64));
+    fs->bitmap_loaded     = calloc(BITMAP_DIRTY_WORDS, sizeof(u64));
+    fs->bitmap_full       = calloc(BITMAP_DIRTY_WORDS, sizeof(u64));
+}
+
+static void destroy_bitmap(SFS* fs) {
+    
+    free(fs->free_block_bitmap);
+    free(fs->bitmap_loaded);
+    free(fs->bitmap_full);
+}
+
+/*INODE SCAN*/
+
+//part of the inode table scanned by one thread
+typedef struct scan_job {
+    SFS*        fs;
+    u32         first_block; //first inode block of the part, counted from the start of the inode table
+    u32         last_block;  //one past the last inode block
+    u64*        bitmap;      //blocks used by the scanned files
+    fsck_report report;
+} scan_job;
+
+//marks block used by the inode, counts blocks already used by another file
+static void scan_mark(scan_job* job, u32 inumber, u32 block_index) {
+    
+    u64* word = &job->bitmap[block_index / BITMAP_WORD_BITS];
+    
+    if(GET_BIT64(*word, block_index % BITMAP_WORD_BITS)) {
+        sfs_log(SFS_ECORRUPT, "fsck: block %u of inode %u is used more than once", block_index, inumber);
+        job->report.double_allocated++;
+        return;
+    }
+    
+    SET_BIT64(*word, block_index % BITMAP_WORD_BITS, 1);
+}
+
+//walks extents and extent chain of one inode, every extent block is read once
+static void scan_inode(scan_job* job, u32 inumber, inode* node) {
+    
+    SFS* fs = job->fs;
+    
+    extent block[SFS_MAX_BLOCK_SIZE / sizeof(extent)];
+    
+    u32 next_block  = node->indirect;
+    u64 blocks_used = 0;
+    
+    job->report.files++;
+    
+    for(u32 i = 0; i < node->extents_num; i++) {
+        
+        u32 slot = (i - INLINE_EXTENTS) % EXTENTS_PER_BLOCK;
+        
+        //load next block of the chain
+        if(i >= INLINE_EXTENTS && slot == 0) {
+            
+            if(next_block < DATA_START || next_block >= fs->blocks) {
+                sfs_log(SFS_ECORRUPT, "fsck: extent chain of inode %u points to invalid block %u", inumber, next_block);
+                job->report.bad_pointers++;
+                return;
+            }
+            
+            scan_mark(job, inumber, next_block);
+            
+            read_range(fs, block, next_block, 0, FS_BLOCK_SIZE);
+            
+            next_block = block[EXTENTS_PER_BLOCK].start;
+        }
+        
+        extent run = (i < INLINE_EXTENTS) ? node->direct[i] : block[slot];
+        
+        if(run.length == 0 || run.start < DATA_START || run.length > fs->blocks - run.start) {
+            sfs_log(SFS_ECORRUPT, "fsck: extent %u of inode %u points to invalid blocks %u+%u", i, inumber, run.start, run.length);
+            job->report.bad_pointers++;
+            continue;
+        }
+        
+        for(u32 block_index = run.start; block_index < run.start + run.length; block_index++) {
+            scan_mark(job, inumber, block_index);
+        }
+        
+        blocks_used += run.length;
+    }
+    
+    //last block of the chain does not link anywhere
+    if(node->extents_num > INLINE_EXTENTS && next_block != SFS_NULL) {
+        sfs_log(SFS_ECORRUPT, "fsck: extent chain of inode %u continues past its last extent", inumber);
+        job->report.bad_pointers++;
+    }
+    
+    if(blocks_used != (node->size + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE) {
+        sfs_log(SFS_ECORRUPT, "fsck: inode %u has size %llu but %llu blocks", inumber, node->size, blocks_used);
+        job->report.bad_sizes++;
+    }
+}
+
+//scans part of the inode table, whole inode blocks are read in batches
+static void* scan_worker(void* arg) {
+    
+    scan_job* job = arg;
+    SFS*      fs  = job->fs;
+    
+    inode* nodes = malloc(SCAN_BATCH_BLOCKS * FS_BLOCK_SIZE);
+    
+    for(u32 first = job->first_block; first < job->last_block; first += SCAN_BATCH_BLOCKS) {
+        
+        u32 count = (job->last_block - first < SCAN_BATCH_BLOCKS) ? job->last_block - first : SCAN_BATCH_BLOCKS;
+        
+        read_range(fs, nodes, 1 + first, 0, count * FS_BLOCK_SIZE);
+        
+        for(u32 i = 0; i < count * INODES_PER_BLOCK; i++) {
+            
+            if(nodes[i].valid) {
+                scan_inode(job, first * INODES_PER_BLOCK + i, &nodes[i]);
+            }
+        }
+    }
+    
+    free(nodes);
+    
+    return NULL;
+}
+
+//marks blocks used by files in bitmap, inode table is split between SFS_SCAN_THREADS threads
+//every thread fills its own bitmap, blocks claimed by two threads are found when they are merged
+static void scan_inodes(SFS* fs, u64* bitmap, fsck_report* report) {
+    
+    u32 threads_num = (fs->inode_blocks < SFS_SCAN_THREADS) ? fs->inode_blocks : SFS_SCAN_THREADS;
+    
+    scan_job  jobs[SFS_SCAN_THREADS];
+    pthread_t threads[SFS_SCAN_THREADS];
+    
+    for(u32 i = 0; i < threads_num; i++) {
+        
+        memset(&jobs[i], 0, sizeof(scan_job));
+        
+        jobs[i].fs          = fs;
+        jobs[i].first_block = (u64)fs->inode_blocks * i / threads_num;
+        jobs[i].last_block  = (u64)fs->inode_blocks * (i + 1) / threads_num;
+        jobs[i].bitmap      = calloc(BITMAP_WORDS, sizeof(u64));
+        
+        pthread_create(&threads[i], NULL, scan_worker, &jobs[i]);
+    }
+    
+    memset(report, 0, sizeof(fsck_report));
+    
+    for(u32 i = 0; i < threads_num; i++) {
+        
+        pthread_join(threads[i], NULL);
+        
+        for(u32 w = 0; w < BITMAP_WORDS; w++) {
+            
+            u64 shared = bitmap[w] & jobs[i].bitmap[w];
+            
+            if(shared != 0) {
+                sfs_log(SFS_ECORRUPT, "fsck: %d blocks starting around block %u are used more than once", __builtin_popcountll(shared), w * BITMAP_WORD_BITS);
+                report->double_allocated += __builtin_popcountll(shared);
+            }
+            
+            bitmap[w] |= jobs[i].bitmap[w];
+        }
+        
+        report->files            += jobs[i].report.files;
+        report->double_allocated += jobs[i].report.double_allocated;
+        report->bad_pointers     += jobs[i].report.bad_pointers;
+        report->bad_sizes        += jobs[i].report.bad_sizes;
+        
+        free(jobs[i].bitmap);
+    }
+}
+
+//writes header to block 0 and waits until it is on disk
+static bool write_header(SFS* fs) {
+    
+    bool flushed = copy_to_block(fs, 0, 0, fs, SFS_HEADER_SIZE);
+    
+    flushed = flush_data(fs) && flushed;
+    
+    return disk_barrier(fs) && flushed;
+}
+
+//format simple file system
+sfs_status format_sfs(char* emu_disk_file, u64 disk_size, u32 block_size, u32 bytes_per_inode, u8 format_mode) {
+    
+    if(block_size == 0)      { block_size      = BLOCK_SIZE; }
+    if(bytes_per_inode == 0) { bytes_per_inode = SFS_BYTES_PER_INODE; }
+    
+    //check block size validity
+    if(block_size < SFS_MIN_BLOCK_SIZE || block_size > SFS_MAX_BLOCK_SIZE || (block_size & (block_size - 1)) != 0)
+    {
+        SFS_ERROR(SFS_EINVAL, "format_sfs() error: block size is not a power of two from 1024 to 65536");
+    }
+    
+    //check disk size validity
+    if(disk_size % block_size != 0)
+    {
+        SFS_ERROR(SFS_EINVAL, "format_sfs() error: disk size is not multiple of block size");
+    }
+    if(disk_size < block_size * 8)
+    {
+        SFS_ERROR(SFS_EINVAL, "format_sfs() error: disk size is not sufficient enough (note: must be at least 8 blocks");
+    }
+    if(disk_size / block_size > 0xffffffff)
+    {
+        SFS_ERROR(SFS_EINVAL, "format_sfs() error: disk size is too big, block index would not fit into 32 bits");
+    }
+    
+    //setup sfs disk
+    SFS  header;
+    SFS* fs = &header;
+    
+    header.magic           = MAGIC_NUMBER;
+    header.block_size      = block_size;
+    header.block_shift     = __builtin_ctz(block_size);
+    header.bytes_per_inode = bytes_per_inode;
+    header.blocks          = disk_size / block_size;
+    header.version         = SFS_VERSION;
+    header.clean           = 1;
+    
+    //inode numbers are 32-bit and DIR_SLOT_DELETED is never one of them
+    u64 inode_blocks = (disk_size / bytes_per_inode + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK;
+    
+    if(inode_blocks == 0)                            { inode_blocks = 1; }
+    if(inode_blocks > 0xffffffff / INODES_PER_BLOCK) { inode_blocks = 0xffffffff / INODES_PER_BLOCK; }
+    
+    header.inode_blocks = inode_blocks;
+    header.inodes       = header.inode_blocks * INODES_PER_BLOCK;
+    
+    //one block per 32 blocks of the disk, journal bigger than one descriptor can describe is not used
+    header.journal_blocks = header.blocks / 32;
+    
+    if(header.journal_blocks < JOURNAL_MIN_BLOCKS)     { header.journal_blocks = JOURNAL_MIN_BLOCKS; }
+    if(header.journal_blocks > 1 + JOURNAL_MAX_BLOCKS) { header.journal_blocks = 1 + JOURNAL_MAX_BLOCKS; }
+    
+    header.bitmap_blocks = (BITMAP_WORDS * sizeof(u64) - 1) / FS_BLOCK_SIZE + 1;
+    
+    if((u64)DATA_START >= header.blocks)
+    {
+        SFS_ERROR(SFS_EINVAL, "format_sfs() error: inode table does not leave any block for data, use more bytes per inode");
+    }
+    
+    header.disk = fopen(emu_disk_file, "wb"); if(header.disk == NULL) { SFS_ERROR(SFS_EIO, "format_sfs error: cannot open emulated drive"); }
+    
+    u64*  bitmap = new_bitmap(&header);
+    char* buffer = calloc(FS_BLOCK_SIZE, sizeof(char));
+    
+    if(bitmap == NULL || buffer == NULL) {
+        free(bitmap);
+        free(buffer);
+        fclose(header.disk);
+        SFS_ERROR(SFS_ENOMEM, "format_sfs error: out of memory");
+    }
+    
+    //root directory, its table is created with the first entry
+    inode root = { SFS_INODE_DIR };
+    
+    //write sfs header and fill rest of the first block with zeros
+    bool written = fwrite((char*)&header, SFS_HEADER_SIZE, 1, header.disk) == 1;
+    
+    written = written && fwrite(buffer, sizeof(char), FS_BLOCK_SIZE - SFS_HEADER_SIZE, header.disk) == FS_BLOCK_SIZE - SFS_HEADER_SIZE;
+    
+    if(format_mode == SFS_FORMAT_ZERO) {
+        
+        //fill rest of the blocks with zeros
+        for(u32 i = 1; written && i < header.blocks; i++)
+        {
+            written = fwrite(buffer, sizeof(char), FS_BLOCK_SIZE, header.disk) == FS_BLOCK_SIZE;
+        }
+    }
+    
+    free(buffer);
+    
+    written = written && fseek(header.disk, (u64)(1 + SFS_ROOT_INODE / INODES_PER_BLOCK) * FS_BLOCK_SIZE + (SFS_ROOT_INODE % INODES_PER_BLOCK) * sizeof(inode), SEEK_SET) == 0;
+    written = written && fwrite(&root, sizeof(inode), 1, header.disk) == 1;
+    
+    //write words with reserved blocks marked, the rest of the bitmap is zero already except the last word
+    u32 words    = (header.blocks - 1) / BITMAP_WORD_BITS + 1;
+    u32 reserved = (header.inode_blocks + header.bitmap_blocks + header.journal_blocks) / BITMAP_WORD_BITS + 1;
+    u32 head     = (reserved < words) ? reserved : words;
+    
+    written = written && fseek(header.disk, (u64)(1 + header.inode_blocks) * FS_BLOCK_SIZE, SEEK_SET) == 0;
+    written = written && fwrite(bitmap, sizeof(u64), head, header.disk) == head;
+    
+    if(reserved < words) {
+        written = written && fseek(header.disk, (u64)(1 + header.inode_blocks) * FS_BLOCK_SIZE + (u64)(words - 1) * sizeof(u64), SEEK_SET) == 0;
+        written = written && fwrite(&bitmap[words - 1], sizeof(u64), 1, header.disk) == 1;
+    }
+    
+    free(bitmap);
+    
+    written = written && fflush(header.disk) == 0;
+    
+    if(!written) {
+        fclose(header.disk);
+        SFS_ERROR(SFS_EIO, "format_sfs error: cannot write emulated drive");
+    }
+    
+    //file was truncated when opened, the extension reads as zeros so inode table is empty
+    if(format_mode != SFS_FORMAT_ZERO && ftruncate(fileno(header.disk), disk_size) != 0) {
+        fclose(header.disk);
+        SFS_ERROR(SFS_EIO, "format_sfs error: cannot resize emulated drive");
+    }
+    
+    if(format_mode == SFS_FORMAT_PREALLOCATE && posix_fallocate(fileno(header.disk), 0, disk_size) != 0) {
+        fclose(header.disk);
+        SFS_ERROR(SFS_ENOSPC, "format_sfs error: cannot preallocate emulated drive");
+    }
+    
+    if(fclose(header.disk) != 0) {
+        SFS_ERROR(SFS_EIO, "format_sfs error: cannot write emulated drive");
+    }
+    
+    return SFS_OK;
+}
+
+//open disk
+SFS* open_sfs(char* emu_disk_file, u8 io_mode) {
+    
+    STAT_TIMER(start);
+    
+    SFS* fs = calloc(1, sizeof(SFS));
+    
+    if(fs == NULL) { SFS_NULL_ERROR(SFS_ENOMEM, "open_sfs error: out of memory"); }
+    
+    fs->disk     = fopen(emu_disk_file, "r+b"); if(fs->disk == NULL) { free(fs); SFS_NULL_ERROR(SFS_EIO, "open_sfs error: cannot open emulated drive"); }
+    fs->io_mode  = io_mode;
+    fs->map      = NULL;
+    fs->map_size = 0;
+    
+    //read super block
+    fread((char*)fs, SFS_HEADER_SIZE, 1, fs->disk);
+    
+    //check header
+    if(fs->magic != MAGIC_NUMBER)
+    {
+        fclose(fs->disk);
+        free(fs);
+        SFS_NULL_ERROR(SFS_EFORMAT, "open_sfs error: read disk is not simple file system formatted");
+    }
+    
+    if(fs->version != SFS_VERSION)
+    {
+        fclose(fs->disk);
+        free(fs);
+        SFS_NULL_ERROR(SFS_EFORMAT, "open_sfs error: disk was formatted with an older version of simple file system, format it again");
+    }
+    
+    if(fs->block_size < SFS_MIN_BLOCK_SIZE || fs->block_size > SFS_MAX_BLOCK_SIZE || (fs->block_size & (fs->block_size - 1)) != 0)
+    {
+        fclose(fs->disk);
+        free(fs);
+        SFS_NULL_ERROR(SFS_EFORMAT, "open_sfs error: block size in the header is not valid");
+    }
+    
+    fs->block_shift = __builtin_ctz(fs->block_size);
+    
+    //map the whole disk
+    if(fs->io_mode == SFS_IO_MMAP) {
+        
+        struct stat disk_stat;
+        
+        fstat(fileno(fs->disk), &disk_stat);
+        
+        if((u64)disk_stat.st_size < (u64)fs->blocks * FS_BLOCK_SIZE) {
+            fclose(fs->disk);
+            free(fs);
+            SFS_NULL_ERROR(SFS_EFORMAT, "open_sfs error: emulated drive is smaller than its header says");
+        }
+        
+        fs->map_size = disk_stat.st_size;
+        fs->map      = mmap(NULL, fs->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(fs->disk), 0);
+        
+        if(fs->map == MAP_FAILED) {
+            fclose(fs->disk);
+            free(fs);
+            SFS_NULL_ERROR(SFS_EIO, "open_sfs error: cannot map emulated drive");
+        }
+    } else {
+        cache_init(fs);
+    }
+    
+    pthread_mutex_init(&fs->alloc_lock, NULL);
+    pthread_mutex_init(&fs->cache_lock, NULL);
+    
+    for(u32 i = 0; i < SFS_INODE_LOCKS; i++) {
+        pthread_mutex_init(&fs->inode_locks[i], NULL);
+    }
+    
+    pthread_mutex_init(&fs->inode_table_lock, NULL);
+    pthread_mutex_init(&fs->journal_mutex, NULL);
+    pthread_rwlock_init(&fs->journal_lock, NULL);
+    pthread_mutex_init(&fs->handle_pool_lock, NULL);
+    pthread_mutex_init(&fs->async_lock, NULL);
+    pthread_cond_init(&fs->async_queued, NULL);
+    pthread_cond_init(&fs->async_finished, NULL);
+    pthread_mutex_init(&fs->stats_lock, NULL);
+    pthread_cond_init(&fs->stats_wake, NULL);
+    
+    fs->async_depth                = SFS_QUEUE_DEPTH;
+    fs->async_counters.queue_depth = SFS_QUEUE_DEPTH;
+    
+    fs->inode_pages = calloc(fs->inode_blocks, sizeof(inode*));
+    fs->inode_dirty = calloc(INODE_PAGE_WORDS, sizeof(u64));
+    
+    init_bitmap(fs);
+    
+    fs->bitmap_dirty  = calloc(BITMAP_DIRTY_WORDS, sizeof(u64));
+    fs->pending_free  = calloc(BITMAP_WORDS, sizeof(u64));
+    fs->pending_dirty = calloc(BITMAP_DIRTY_WORDS, sizeof(u64));
+    fs->alloc_cursor = DATA_START;
+    
+    //only the last commit can be missing from its places, recovery does not depend on the size of the disk
+    if(!fs->clean) {
+        journal_replay(fs);
+    }
+    
+    //journal has to be replayed if the disk is not closed
+    fs->clean = 0;
+    
+    if(!write_header(fs)) {
+        destroy_sfs(fs);
+        SFS_NULL_ERROR(SFS_EIO, "open_sfs error: header cannot be written");
+    }
+    
+    STAT_LATENCY(fs->mount_latency, start);
+    
+    return fs;
+}
+
+//close disk, the handle is released even when the last commit fails
+sfs_status close_sfs(SFS* fs) {
+    
+    sfs_set_stats_dump(fs, NULL, 0);
+    
+    async_shutdown(fs);
+    
+    //everything must be in place before the disk is marked clean
+    sfs_status status = journal_commit(fs);
+    
+    if(status == SFS_OK && !disk_barrier(fs)) {
+        status = SFS_EIO;
+    }
+    
+    //disk that lost writes stays unclean, the last complete commit is replayed at the next mount
+    if(status == SFS_OK) {
+        
+        fs->clean = 1;
+        
+        if(!write_header(fs)) {
+            status = SFS_EIO;
+        }
+    }
+    
+    destroy_sfs(fs);
+    
+    return status;
+}
+
+//releases the handle without touching the disk
+static void destroy_sfs(SFS* fs) {
+    
+    if(fs->io_mode == SFS_IO_MMAP) {
+        munmap(fs->map, fs->map_size);
+        fs->map = NULL;
+    } else {
+        cache_destroy(fs);
+    }
+    
+    for(u32 i = 0; i < SFS_INODE_LOCKS; i++) {
+        pthread_mutex_destroy(&fs->inode_locks[i]);
+    }
+    
+    pthread_mutex_destroy(&fs->alloc_lock);
+    pthread_mutex_destroy(&fs->cache_lock);
+    pthread_mutex_destroy(&fs->inode_table_lock);
+    pthread_mutex_destroy(&fs->journal_mutex);
+    pthread_rwlock_destroy(&fs->journal_lock);
+    pthread_mutex_destroy(&fs->handle_pool_lock);
+    pthread_mutex_destroy(&fs->async_lock);
+    pthread_cond_destroy(&fs->async_queued);
+    pthread_cond_destroy(&fs->async_finished);
+    pthread_mutex_destroy(&fs->stats_lock);
+    pthread_cond_destroy(&fs->stats_wake);
+    
+    for(u32 i = 0; i < fs->inode_loaded_num; i++) {
+        free(fs->inode_pages[fs->inode_loaded[i]]);
+    }
+    
+    free(fs->inode_pages);
+    free(fs->inode_loaded);
+    free(fs->inode_dirty);
+    free(fs->bitmap_dirty);
+    free(fs->pending_free);
+    free(fs->pending_dirty);
+    free(fs->journal_targets);
+    free(fs->journal_images);
+    free(fs->journal_buffer);
+    
+    for(u32 i = 0; i < fs->handle_pool_num; i++) {
+        free_handle(fs->handle_pool[i]);
+    }
+    
+    fclose(fs->disk);
+    destroy_bitmap(fs);
+    free(fs);
+}
+
+//commits all updates done so far
+sfs_status sync_sfs(SFS* fs) {
+    return journal_commit(fs);
+}
+
+//returns block cache counters
+void get_cache_stats(SFS* fs, cache_stats* stats) {
+    
+    pthread_mutex_lock(&fs->cache_lock);
+    
+    *stats = fs->cache_counters;
+    
+    pthread_mutex_unlock(&fs->cache_lock);
+}
+
+//returns disk I/O counters
+void get_io_stats(SFS* fs, io_stats* stats) {
+    stat_copy(stats, &fs->io_counters, sizeof(io_stats));
+}
+
+//returns heap allocation counters of file operations
+void get_memory_stats(SFS* fs, memory_stats* stats) {
+    stat_copy(stats, &fs->memory_counters, sizeof(memory_stats));
+}
+
+//checks all files against each other and against the bitmap, filesystem should be idle
+u32 fsck_sfs(SFS* fs, fsck_report* report) {
+    
+    //scan reads inode and extent blocks from disk, pending frees are applied to the bitmap
+    journal_commit(fs);
+    
+    u64* bitmap = new_bitmap(fs);
+    
+    scan_inodes(fs, bitmap, report);
+    
+    inode root;
+    
+    read_inode(fs, SFS_ROOT_INODE, &root);
+    
+    if(root.valid != SFS_INODE_DIR) {
+        sfs_log(SFS_ECORRUPT, "fsck: root directory is missing");
+        report->bad_root = 1;
+    }
+    
+    pthread_mutex_lock(&fs->alloc_lock);
+    
+    for(u32 w = 0; w < BITMAP_WORDS; w++) {
+        
+        u64 different = bitmap[w] ^ *bitmap_word(fs, w * BITMAP_WORD_BITS);
+        
+        if(different != 0) {
+            sfs_log(SFS_ECORRUPT, "fsck: %d blocks starting around block %u disagree with the bitmap", __builtin_popcountll(different), w * BITMAP_WORD_BITS);
+            report->bitmap_mismatches += __builtin_popcountll(different);
+        }
+    }
+    
+    pthread_mutex_unlock(&fs->alloc_lock);
+    
+    free(bitmap);
+    
+    return report->double_allocated + report->bad_pointers + report->bad_sizes + report->bitmap_mismatches + report->bad_root;
+}
+
+//read block
+u32 read_block(SFS* fs, void* buffer, u32 block_index, u32 size) {
+
+    if(block_index + 1 > fs->blocks) {
+        SFS_ZERO_ERROR(SFS_EINVAL, "read_block error: block index out of range");
+    }
+
+    if(size > FS_BLOCK_SIZE) {
+        SFS_ZERO_ERROR(SFS_EINVAL, "read_block error: buffer size is bigger than block size");
+    }
+
+    if(!copy_from_block(fs, block_index, 0, buffer, size)) { return 0; }
+
+    return size;
+}
+
+u32 write_block(SFS* fs, void* buffer, u32 block_index, u32 size) {
+
+    if(block_index + 1 > fs->blocks) {
+        SFS_ZERO_ERROR(SFS_EINVAL, "write_block error: block index out of range");
+    }
+
+    if(size > FS_BLOCK_SIZE) {
+        SFS_ZERO_ERROR(SFS_EINVAL, "write_block error: buffer size is bigger than block size");
+    }
+
+    if(!copy_to_block(fs, block_index, 0, buffer, size)) { return 0; }
+
+    return size;
+}
+
+//read contiguous blocks
+u32 read_blocks(SFS* fs, void* buffer, u32 first_block, u32 count) {
+    
+    if(first_block >= fs->blocks || count > fs->blocks - first_block) {
+        SFS_ZERO_ERROR(SFS_EINVAL, "read_blocks error: block index out of range");
+    }
+    
+    return read_range(fs, buffer, first_block, 0, count * FS_BLOCK_SIZE);
+}
+
+//write contiguous blocks
+u32 write_blocks(SFS* fs, void* buffer, u32 first_block, u32 count) {
+    
+    if(first_block >= fs->blocks || count > fs->blocks - first_block) {
+        SFS_ZERO_ERROR(SFS_EINVAL, "write_blocks error: block index out of range");
+    }
+    
+    return write_range(fs, buffer, first_block, 0, count * FS_BLOCK_SIZE);
+}
+
+//returns first free block at or after from, wraps around the disk, 0 if there is none
+//bitmap blocks known to be full are skipped without reading them
+static u32 find_free_block(SFS* fs, u32 from) {
+    
+    u32 word    = from / BITMAP_WORD_BITS;
+    u64 mask    = ~0ULL << (from % BITMAP_WORD_BITS); //ignore blocks before from in the first word
+    u64 covered = 0;                                  //words searched or skipped, the first one is searched twice
+    u32 scanned = 0;
+    
+    while(covered <= BITMAP_WORDS) {
+        
+        u32 page  = word / BITMAP_BLOCK_WORDS;
+        u32 first = page * BITMAP_BLOCK_WORDS;
+        u32 end   = (first + BITMAP_BLOCK_WORDS < BITMAP_WORDS) ? first + BITMAP_BLOCK_WORDS : BITMAP_WORDS;
+        
+        if(GET_BIT64(fs->bitmap_full[page / BITMAP_WORD_BITS], page % BITMAP_WORD_BITS)) {
+            covered += end - word;
+        } else {
+            
+            bool whole = word == first && mask == ~0ULL;
+            
+            //reads the bitmap block on first use
+            bitmap_word(fs, word * BITMAP_WORD_BITS);
+            
+            for(; word < end && covered <= BITMAP_WORDS; word++, covered++, scanned++) {
+                
+                u64 free_bits = ~fs->free_block_bitmap[word] & mask;
+                
+                mask = ~0ULL;
+                
+                if(free_bits) {
+                    STAT_ADD(fs->op_counters.alloc_scanned, scanned + 1);
+                    return word * BITMAP_WORD_BITS + __builtin_ctzll(free_bits);
+                }
+            }
+            
+            if(whole && word == end) {
+                SET_BIT64(fs->bitmap_full[page / BITMAP_WORD_BITS], page % BITMAP_WORD_BITS, 1);
+            }
+        }
+        
+        word = (end == BITMAP_WORDS) ? 0 : end;
+        mask = ~0ULL;
+    }
+    
+    STAT_ADD(fs->op_counters.alloc_scanned, scanned);
+    
+    return SFS_NULL;
+}
+
+//returns number of free blocks starting at block_index, at most max
+static u32 free_run_length(SFS* fs, u32 block_index, u32 max) {
+    
+    u32 length = 0;
+    
+    while(length < max && block_index + length < fs->blocks) {
+        
+        u32 i    = block_index + length;
+        u64 used = *bitmap_word(fs, i) >> (i % BITMAP_WORD_BITS);
+        
+        //whole rest of the word is free
+        if(used == 0) {
+            length += BITMAP_WORD_BITS - i % BITMAP_WORD_BITS;
+            continue;
+        }
+        
+        length += __builtin_ctzll(used);
+        break;
+    }
+    
+    return (length > max) ? max : length;
+}
+
+u32 get_free_node(SFS* fs) {
+
+    pthread_mutex_lock(&fs->alloc_lock);
+    
+    STAT_ADD(fs->op_counters.alloc_searches, 1);
+    
+    u32 block_index = find_free_block(fs, fs->alloc_cursor);
+    
+    if(block_index != SFS_NULL) {
+        fs->alloc_cursor = (block_index + 1 == fs->blocks) ? 0 : block_index + 1;
+    }
+    
+    pthread_mutex_unlock(&fs->alloc_lock);
+    
+    if(block_index == SFS_NULL) {
+        SFS_ZERO_ERROR(SFS_ENOSPC, "get_free_node error: out of physical memory");
+    }
+    
+    return block_index;
+}
+
+//next-fit search for count contiguous free blocks, allocator lock must be held
+//at most max_runs free runs are looked at, if none of them is that long the longest one is returned
+static u32 find_free_extent(SFS* fs, u32 count, u32 max_runs, u32* length) {
+    
+    u32 best_start  = SFS_NULL;
+    u32 best_length = 0;
+    
+    u32 position    = fs->alloc_cursor;
+    u32 scanned     = 0;
+    
+    STAT_ADD(fs->op_counters.alloc_searches, 1);
+    
+    for(u32 runs = 0; runs < max_runs && scanned < fs->blocks; runs++) {
+        
+        u32 start = find_free_block(fs, position);
+        
+        if(start == SFS_NULL) { break; }
+        
+        //stop after going around the whole disk
+        u32 distance = (start >= position) ? start - position : fs->blocks - position + start;
+        
+        if(scanned + distance >= fs->blocks) { break; }
+        
+        u32 run = free_run_length(fs, start, count);
+        
+        if(run > best_length) {
+            best_start  = start;
+            best_length = run;
+        }
+        
+        if(run == count) { break; }
+        
+        scanned += distance + run;
+        position = (start + run >= fs->blocks) ? 0 : start + run;
+    }
+    
+    *length = best_length;
+    
+    if(best_start == SFS_NULL) {
+        SFS_ZERO_ERROR(SFS_ENOSPC, "get_free_extent error: out of physical memory");
+    }
+    
+    fs->alloc_cursor = (best_start + best_length >= fs->blocks) ? 0 : best_start + best_length;
+    
+    return best_start;
+}
+
+u32 get_free_extent(SFS* fs, u32 count, u32* length) {
+    
+    pthread_mutex_lock(&fs->alloc_lock);
+    
+    u32 start = find_free_extent(fs, count, EXTENT_SEARCH_RUNS, length);
+    
+    pthread_mutex_unlock(&fs->alloc_lock);
+    
+    return start;
+}
+
+//marks count distinct free blocks as allocated and stores their indexes into blocks
+//returns count, or 0 if the disk cannot hold them all, then nothing is claimed
+u32 reserve_blocks(SFS* fs, u32* blocks, u32 count) {
+    
+    u32 reserved = 0;
+    
+    pthread_mutex_lock(&fs->alloc_lock);
+    
+    while(reserved < count) {
+        
+        //after a short run the free space around the cursor is fragmented, following runs are taken as they come
+        u32 run_length;
+        u32 run_start = find_free_extent(fs, count - reserved, (reserved == 0) ? EXTENT_SEARCH_RUNS : 1, &run_length);
+        
+        //roll back what was claimed so far
+        if(run_start == SFS_NULL) {
+            
+            for(u32 i = 0; i < reserved; i++) {
+                MARK_BLOCK(blocks[i], 0);
+            }
+            
+            pthread_mutex_unlock(&fs->alloc_lock);
+            SFS_ZERO_ERROR(SFS_ENOSPC, "reserve_blocks error: out of physical memory");
+        }
+        
+        for(u32 i = 0; i < run_length; i++) {
+            
+            MARK_BLOCK(run_start + i, 1);
+            
+            blocks[reserved++] = run_start + i;
+        }
+    }
+    
+    pthread_mutex_unlock(&fs->alloc_lock);
+    
+    return count;
+}
+
+void release_blocks(SFS* fs, u32* blocks, u32 count) {
+    
+    pthread_mutex_lock(&fs->alloc_lock);
+    
+    for(u32 i = 0; i < count; i++) {
+        FREE_BLOCK(blocks[i]);
+    }
+    
+    pthread_mutex_unlock(&fs->alloc_lock);
+}
+
+/*FILE IMPLEMENTATION*/
+
+//returns all blocks of the node to the free pool, they are reused after the next commit
+static void release_inode_blocks(SFS* fs, inode* node) {
+    
+    pthread_mutex_lock(&fs->alloc_lock);
+    
+    //deallocate the extents
+    for(u32 i = 0; i < node->extents_num; i++) {
+        
+        extent run = get_extent(fs, node, i);
+        
+        for(u32 j = 0; j < run.length; j++) {
+            FREE_BLOCK(run.start + j);
+        }
+    }
+    
+    //extent chain
+    release_extent_blocks(fs, node, 0);
+    
+    pthread_mutex_unlock(&fs->alloc_lock);
+}
+
+//deletes inode, inode lock must be held
+static void delete_inode(SFS* fs, u32 index) {
+    
+    //load the node
+    inode node;
+    
+    read_inode(fs, index, &node);
+    
+    //if node is not active ignore everything
+    if(!node.valid) { return; }
+    
+    inode unused = node;
+    
+    unused.valid = 0;
+    
+    //blocks stay allocated while the inode still points to them
+    if(!write_inode(fs, index, &unused)) { return; }
+    
+    release_inode_blocks(fs, &node);
+}
+
+//points the handle to the node as if it was just opened, its arrays are kept for reuse
+static void reset_handle(sfs_file* file, inode* node) {
+    
+    sfs_file reset = { 0 };
+    
+    reset.fs               = file->fs;
+    reset.inumber          = file->inumber;
+    reset.node             = *node;
+    reset.extents          = file->extents;
+    reset.extent_starts    = file->extent_starts;
+    reset.extents_capacity = file->extents_capacity;
+    reset.chain            = file->chain;
+    reset.chain_capacity   = file->chain_capacity;
+    reset.append_buffer    = file->append_buffer;
+    reset.append_capacity  = file->append_capacity;
+    
+    *file = reset;
+}
+
+//creates handle of the node, closed handles are reused with their arrays
+static sfs_file* new_handle(SFS* fs, u32 index, inode* node) {
+    
+    sfs_file* file = NULL;
+    
+    pthread_mutex_lock(&fs->handle_pool_lock);
+    
+    if(fs->handle_pool_num != 0) {
+        file = fs->handle_pool[--fs->handle_pool_num];
+    }
+    
+    pthread_mutex_unlock(&fs->handle_pool_lock);
+    
+    if(file == NULL) {
+        
+        file = fs_calloc(fs, 1, sizeof(sfs_file));
+        
+    } else {
+        STAT_ADD(fs->memory_counters.handles_reused, 1);
+    }
+    
+    file->fs      = fs;
+    file->inumber = index;
+    
+    reset_handle(file, node);
+    
+    return file;
+}
+
+static void free_handle(sfs_file* file) {
+    
+    free(file->extents);
+    free(file->extent_starts);
+    free(file->chain);
+    free(file->append_buffer);
+    free(file);
+}
+
+//returns handle to the pool, extent chain must be already flushed
+static void release_handle(sfs_file* file) {
+    
+    SFS* fs = file->fs;
+    
+    pthread_mutex_lock(&fs->handle_pool_lock);
+    
+    if(fs->handle_pool_num < SFS_HANDLE_POOL) {
+        fs->handle_pool[fs->handle_pool_num++] = file;
+        file = NULL;
+    }
+    
+    pthread_mutex_unlock(&fs->handle_pool_lock);
+    
+    if(file != NULL) {
+        free_handle(file);
+    }
+}
+
+//TODO: implement modes, now only supporing "wb"
+//opens file if doesn't exist create it, create - SFS_MODE_WRITE may create a missing file
+static sfs_file* open_file(SFS* fs, u32 index, u8 mode, bool create) {
+    
+    if(index >= fs->inodes) {
+        SFS_NULL_ERROR(SFS_EINVAL, "sfs_open_file error: index out of range");
+    }
+
+    journal_begin(fs);
+    
+    pthread_mutex_lock(INODE_LOCK(index));
+    
+    //open desired node
+    inode node;
+
+    if(!read_inode(fs, index, &node)) {
+        pthread_mutex_unlock(INODE_LOCK(index));
+        journal_end(fs);
+        return NULL;
+    }
+
+    //check mode
+    if(!node.valid && (mode == SFS_MODE_READ || !create)) {
+        pthread_mutex_unlock(INODE_LOCK(index));
+        journal_end(fs);
+        SFS_NULL_ERROR(SFS_ENOENT, "sfs_open_file error: file doesn't exist");
+    }
+    
+    if(node.valid == SFS_INODE_DIR) {
+        pthread_mutex_unlock(INODE_LOCK(index));
+        journal_end(fs);
+        SFS_NULL_ERROR(SFS_EISDIR, "sfs_open_file error: inode is a directory");
+    }
+    
+    //reset the node
+    if(!node.valid || mode == SFS_MODE_WRITE) {
+        
+        delete_inode(fs, index);
+        
+        memset(&node, 0, sizeof(node));
+        
+        node.valid = SFS_INODE_FILE;
+
+        write_inode(fs, index, &node);
+    }
+    
+    pthread_mutex_unlock(INODE_LOCK(index));
+    
+    journal_end(fs);
+    
+    //create file
+    return new_handle(fs, index, &node);
+}
+
+sfs_file* sfs_open_file (SFS* fs, u32 index, u8 mode) {
+    
+    STAT_TIMER(start);
+    
+    sfs_file* file = open_file(fs, index, mode, true);
+    
+    STAT_LATENCY(fs->open_latency, start);
+    
+    return file;
+}
+
+//closes file, the handle is released even when its buffered appends cannot be written
+sfs_status sfs_close_file(sfs_file* file) {
+    
+    SFS* fs = file->fs;
+    
+    sfs_status status = sfs_flush_file(file) ? SFS_OK : sfs_last_error();
+    
+    journal_begin(fs);
+
+    pthread_mutex_lock(INODE_LOCK(file->inumber));
+    
+    if(!flush_extents(file) && status == SFS_OK) {
+        status = sfs_last_error();
+    }
+    
+    pthread_mutex_unlock(INODE_LOCK(file->inumber));
+    
+    journal_end(fs);
+
+    release_handle(file);
+    
+    return status;
+}
+
+//moves data between the buffer and already allocated part of the file
+//every run of physically contiguous blocks is moved with one I/O
+static u32 transfer_file(sfs_file* file, char* buffer, u32 size, u64 offset, bool write) {
+    
+    SFS* fs = file->fs;
+    
+    u32 done = 0;
+    
+    while(done < size) {
+        
+        block_range range = map_range(fs, offset + done, size - done);
+        
+        u32 run;
+        u32 first_block  = map_file_block(file, range.first, &run);
+        u32 block_offset = range.offset;
+        
+        //past allocated blocks
+        if(run == 0) { break; }
+        
+        u32 bytes = size - done;
+        
+        if((u64)run * FS_BLOCK_SIZE - block_offset < bytes) {
+            bytes = run * FS_BLOCK_SIZE - block_offset;
+        }
+        
+        if(write) {
+            bytes = write_range(fs, buffer + done, first_block, block_offset, bytes);
+        } else if(file->readahead_cached) {
+            bytes = read_cached(fs, buffer + done, first_block, block_offset, bytes);
+        } else {
+            bytes = read_range(fs, buffer + done, first_block, block_offset, bytes);
+        }
+        
+        if(bytes == 0) { break; }
+        
+        done += bytes;
+    }
+    
+    return done;
+}
+
+//read file at offset, data pointer is not moved
+//no locks are taken, readers of different files never wait for each other
+u32  sfs_pread (sfs_file* file, void* buffer, u32 size, u64 offset) {
+    
+    if(!sfs_flush_file(file)) { return 0; }
+    
+    if(size == 0 || offset >= file->node.size) { return 0; }
+    
+    if(size > file->node.size - offset) {
+        size = file->node.size - offset;
+    }
+    
+    if(!load_extents(file)) { return 0; }
+    
+    return transfer_file(file, buffer, size, offset, false);
+}
+
+//detects reads continuing where the previous one ended and prefetches blocks ahead of them
+//window starts at READAHEAD_MIN_BLOCKS and doubles with every sequential read up to SFS_READAHEAD_BLOCKS
+static void read_ahead(sfs_file* file, u32 size) {
+    
+    SFS* fs = file->fs;
+    
+    u64 position = file->data_pointer;
+    
+    if(position != file->readahead_next) {
+        file->readahead_window = 0;
+        file->readahead_end    = 0;
+    } else if(file->readahead_window == 0) {
+        file->readahead_window = READAHEAD_MIN_BLOCKS;
+    } else if(file->readahead_window * 2 <= SFS_READAHEAD_BLOCKS) {
+        file->readahead_window *= 2;
+    }
+    
+    file->readahead_next = position + size;
+    
+    //reads of several blocks are already one I/O per contiguous run, they are not worth an extra copy
+    bool small = size < READAHEAD_MIN_BLOCKS * FS_BLOCK_SIZE;
+    
+    file->readahead_cached = file->readahead_window != 0 && small && fs->io_mode == SFS_IO_STDIO;
+    
+    if(file->readahead_window == 0 || !small || size == 0 || position >= file->node.size) { return; }
+    
+    block_range range = map_range(fs, position, size);
+    
+    u32 first_block = range.first;
+    u32 next_block  = range.first + range.count;
+    u32 file_blocks = (file->node.size + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+    u32 end         = ((u64)next_block + file->readahead_window < file_blocks) ? next_block + file->readahead_window : file_blocks;
+    
+    if(file->readahead_end < first_block) {
+        file->readahead_end = first_block;
+    }
+    
+    //prefetched blocks must fit into the cache
+    if(end > file->readahead_end && end - file->readahead_end > SFS_CACHE_BLOCKS / 2) {
+        end = file->readahead_end + SFS_CACHE_BLOCKS / 2;
+    }
+    
+    //prefetch in batches, only when less than half of the window is loaded ahead
+    if((u64)file->readahead_end >= (u64)next_block + file->readahead_window / 2 || file->readahead_end >= end) { return; }
+    
+    if(!load_extents(file)) { return; }
+    
+    for(u32 block = file->readahead_end, run; block < end; block += run) {
+        
+        u32 disk_block = map_file_block(file, block, &run);
+        
+        if(run == 0) { break; }
+        
+        if(run > end - block) {
+            run = end - block;
+        }
+        
+        prefetch_range(fs, disk_block, run);
+    }
+    
+    file->readahead_end = end;
+}
+
+//read file, sequential reads are read ahead
+u32  sfs_read_file (void* buffer, u32 size, sfs_file* file) {
+    
+    STAT_TIMER(start);
+    
+    if(!sfs_flush_file(file)) { return 0; }
+    
+    read_ahead(file, size);
+
+    u32 bytes_read = sfs_pread(file, buffer, size, file->data_pointer);
+    
+    file->data_pointer += bytes_read;
+    
+    STAT_LATENCY(file->fs->read_latency, start);
+
+    return bytes_read;
+}
+
+static void release_blocks_array(u32* blocks_array, u32* blocks_local) {
+    
+    if(blocks_array != blocks_local) {
+        free(blocks_array);
+    }
+}
+
+//appends data to the end of the file, inode lock must be held
+static u32 append_file(sfs_file* file, void* buffer, u32 size) {
+    
+    SFS* fs = file->fs;
+    
+    if(size == 0) { return 0; }
+
+    if(size > MAX_FILE_SIZE(fs) - file->node.size) {
+        SFS_ZERO_ERROR(SFS_EFBIG, "sfs_write_file error: size of data is too big");
+    }
+
+    //the write adds at most one extent per block
+    if(!grow_extents(file, size / FS_BLOCK_SIZE + 1)) { return 0; }
+    
+    //create backup
+    sfs_file file_copy = *file;
+
+    //the appended range starts in the last block when it is partial, the rest needs new blocks
+    block_range range     = map_range(fs, file_copy.node.size, size);
+    
+    u32 data_index        = range.first;
+    u32 data_offset       = range.offset;
+    
+    u32 remaining_space_in_last_block = (data_offset == 0) ? 0 : FS_BLOCK_SIZE - data_offset;
+    
+    u32 blocks_num        = range.count - (data_offset != 0);
+    u32 bytes_written     = 0;
+    
+    //appends of buffered data fit on the stack
+    u32  blocks_local[APPEND_LOCAL_BLOCKS];
+    u32* blocks_array     = (blocks_num <= APPEND_LOCAL_BLOCKS) ? blocks_local : fs_malloc(fs, blocks_num * sizeof(u32));
+    char* buffer_pointer  = buffer;
+    
+    //claim all blocks at once
+    if(blocks_num != 0 && reserve_blocks(fs, blocks_array, blocks_num) == 0) {
+        release_blocks_array(blocks_array, blocks_local);
+        SFS_ZERO_ERROR(SFS_ENOSPC, "sfs_write_file error: out of physical memory");
+    }
+    
+    //record new blocks in the handle extents, extent blocks are written when the write is done
+    u32 old_last_length = (file->node.extents_num != 0) ? file_copy.extents[file->node.extents_num - 1].length : 0;
+    
+    for(u32 i = 0; i < blocks_num; i++) {
+        append_extent(&file_copy, blocks_array[i]);
+    }
+    
+    if(!grow_chain(&file_copy)) {
+        
+        //undo the appends, the handle shares extent arrays with the copy
+        if(file->node.extents_num != 0) {
+            file_copy.extents[file->node.extents_num - 1].length = old_last_length;
+        }
+        
+        file->chain          = file_copy.chain;
+        file->chain_capacity = file_copy.chain_capacity;
+        
+        release_blocks(fs, blocks_array, blocks_num);
+        release_blocks_array(blocks_array, blocks_local);
+        SFS_ZERO_ERROR(sfs_last_error(), "sfs_write_file error: extent chain cannot grow");
+    }
+    
+    //data goes to the rest of the last block and then to the new blocks
+    //pieces which are physically contiguous are written with one I/O, no bounce buffer
+    u32 segment_block  = SFS_NULL;
+    u32 segment_offset = 0;
+    u32 segment_bytes  = 0;
+    
+    //if there is space in the last block fill it
+    //this will not run when the file is empty
+    if(remaining_space_in_last_block != 0) {
+        
+        u32 run;
+        
+        segment_block  = map_file_block(&file_copy, data_index, &run);
+        segment_offset = data_offset;
+        segment_bytes  = (size < remaining_space_in_last_block) ? size : remaining_space_in_last_block;
+    }
+    
+    for(u32 i = 0; i < blocks_num; i++) {
+        
+        //ending block may be partial
+        u32 bytes = (i == blocks_num - 1) ? range.tail : FS_BLOCK_SIZE;
+        
+        //block directly follows the segment
+        if(segment_bytes != 0 && (segment_offset + segment_bytes) % FS_BLOCK_SIZE == 0 &&
+           blocks_array[i] == segment_block + (segment_offset + segment_bytes) / FS_BLOCK_SIZE) {
+            
+            segment_bytes += bytes;
+            continue;
+        }
+        
+        if(segment_bytes != 0) {
+            
+            bytes_written  += write_range(fs, buffer_pointer, segment_block, segment_offset, segment_bytes);
+            buffer_pointer += segment_bytes;
+        }
+        
+        segment_block  = blocks_array[i];
+        segment_offset = 0;
+        segment_bytes  = bytes;
+    }
+    
+    if(segment_bytes != 0) {
+        bytes_written += write_range(fs, buffer_pointer, segment_block, segment_offset, segment_bytes);
+    }
+    
+    file_copy.node.size += bytes_written;
+    
+    //flush the file, the appended blocks are released if the inode cannot point to them
+    if(!write_inode(fs, file->inumber, &file_copy.node)) {
+        
+        if(file->node.extents_num != 0) {
+            file_copy.extents[file->node.extents_num - 1].length = old_last_length;
+        }
+        
+        file->chain          = file_copy.chain;
+        file->chain_capacity = file_copy.chain_capacity;
+        
+        release_blocks(fs, file_copy.chain + file->chain_num, file_copy.chain_num - file->chain_num);
+        release_blocks(fs, blocks_array, blocks_num);
+        release_blocks_array(blocks_array, blocks_local);
+        return 0;
+    }
+    
+    *file = file_copy;
+    
+    release_blocks_array(blocks_array, blocks_local);
+    
+    return bytes_written;
+}
+
+//takes over changes made to the file through its other handles, inode lock must be held
+static bool refresh_handle(sfs_file* file) {
+    
+    inode node;
+    
+    if(!read_inode(file->fs, file->inumber, &node)) { return false; }
+    
+    if(!node.valid) { SFS_ZERO_ERROR(SFS_ENOENT, "sfs_write_file error: file was deleted"); }
+    
+    if(file->extents_loaded && memcmp(&node, &file->node, sizeof(inode)) == 0) { return true; }
+    
+    file->node           = node;
+    file->extents_loaded = 0;
+    
+    return load_extents(file);
+}
+
+//writes file at offset, data past the end of the file are appended, buffered appends must be flushed
+//append - offset is the end of the file, other handles may have moved it
+static u32 write_file_section(sfs_file* file, void* buffer, u32 size, u64 offset, bool append) {
+    
+    SFS* fs = file->fs;
+    
+    journal_begin(fs);
+    
+    pthread_mutex_lock(INODE_LOCK(file->inumber));
+    
+    if(!refresh_handle(file)) {
+        pthread_mutex_unlock(INODE_LOCK(file->inumber));
+        journal_end(fs);
+        return 0;
+    }
+    
+    if(append) {
+        offset = file->node.size;
+    }
+    
+    if(offset > file->node.size) {
+        pthread_mutex_unlock(INODE_LOCK(file->inumber));
+        journal_end(fs);
+        SFS_ZERO_ERROR(SFS_EINVAL, "sfs_pwrite error: offset is past the end of file");
+    }
+    
+    //overwrite existing data
+    u32 overwrite = (size < file->node.size - offset) ? size : file->node.size - offset;
+    u32 written   = transfer_file(file, buffer, overwrite, offset, true);
+    
+    //append the rest
+    if(written == overwrite && size > overwrite) {
+        written += append_file(file, (char*)buffer + overwrite, size - overwrite);
+    }
+    
+    //other handles load the extent chain from the journal, a failed flush is retried by the next write or close
+    flush_extents(file);
+    
+    pthread_mutex_unlock(INODE_LOCK(file->inumber));
+    
+    journal_end(fs);
+    
+    return written;
+}
+
+//the rest of a write which ran out of space is written again after blocks freed before it are committed
+static u32 write_file_at(sfs_file* file, void* buffer, u32 size, u64 offset, bool append) {
+    
+    u32 written = write_file_section(file, buffer, size, offset, append);
+    
+    if(written != size && commit_frees(file->fs)) {
+        written += write_file_section(file, (char*)buffer + written, size - written, offset + written, append);
+    }
+    
+    return written;
+}
+
+//write file at offset, data past the end of the file are appended
+//offset must not be past the end of the file
+u32  sfs_pwrite(sfs_file* file, void* buffer, u32 size, u64 offset) {
+    
+    if(size == 0) { return 0; }
+    
+    if(!sfs_flush_file(file)) { return 0; }
+    
+    return write_file_at(file, buffer, size, offset, false);
+}
+
+//writes buffered appends, blocks for all of them are allocated at once
+u32  sfs_flush_file(sfs_file* file) {
+    
+    u32 size = file->append_buffered;
+    
+    if(size == 0) { return 1; }
+    
+    u32 written = write_file_at(file, file->append_buffer, size, 0, true);
+    
+    //bytes which were not written stay buffered, the flush can be tried again
+    file->append_buffered = size - written;
+    
+    if(written != size) {
+        memmove(file->append_buffer, file->append_buffer + written, size - written);
+        SFS_ZERO_ERROR(sfs_last_error(), "sfs_flush_file error: buffered data cannot be written");
+    }
+    
+    return 1;
+}
+
+//appends smaller than SFS_APPEND_BUFFER are collected in the handle and written together
+static u32 write_file(void* buffer, u32 size, sfs_file* file) {
+    
+    SFS* fs = file->fs;
+    
+    //handle may have no buffer yet
+    if(size == 0) { return 0; }
+    
+    //buffered appends go first, the end of the file moves with them
+    if(size >= SFS_APPEND_BUFFER) {
+        return sfs_flush_file(file) ? write_file_at(file, buffer, size, 0, true) : 0;
+    }
+    
+    if(file->append_buffered + size > SFS_APPEND_BUFFER && !sfs_flush_file(file)) { return 0; }
+    
+    //buffer grows with the appends, handles of small files keep it small
+    if(file->append_buffered + size > file->append_capacity) {
+        
+        u32 capacity = (file->append_capacity == 0) ? FS_BLOCK_SIZE : file->append_capacity;
+        
+        while(capacity < file->append_buffered + size) {
+            capacity *= 2;
+        }
+        
+        char* append_buffer = fs_realloc(fs, file->append_buffer, capacity);
+        
+        if(append_buffer == NULL) {
+            return sfs_flush_file(file) ? write_file_at(file, buffer, size, 0, true) : 0;
+        }
+        
+        file->append_buffer   = append_buffer;
+        file->append_capacity = capacity;
+    }
+    
+    memcpy(file->append_buffer + file->append_buffered, buffer, size);
+    
+    file->append_buffered += size;
+    
+    return size;
+}
+
+//write file, data are appended to the end
+u32  sfs_write_file(void* buffer, u32 size, sfs_file* file) {
+    
+    STAT_TIMER(start);
+    
+    u32 written = write_file(buffer, size, file);
+    
+    STAT_LATENCY(file->fs->write_latency, start);
+    
+    return written;
+}
+
+//delete inode
+sfs_status sfs_delet_file(SFS* fs, u32 index) {
+
+    if(index >= fs->inodes) {
+        SFS_ERROR(SFS_EINVAL, "sfs_delet_file error: index out of bounds");
+    }
+
+    if(index == SFS_ROOT_INODE) {
+        SFS_ERROR(SFS_EISDIR, "sfs_delet_file error: root directory cannot be deleted");
+    }
+
+    journal_begin(fs);
+    
+    pthread_mutex_lock(INODE_LOCK(index));
+    
+    inode node;
+    
+    if(!read_inode(fs, index, &node)) {
+        pthread_mutex_unlock(INODE_LOCK(index));
+        journal_end(fs);
+        return sfs_last_error();
+    }
+    
+    //directories are removed by sfs_unlink, which checks they are empty
+    if(node.valid == SFS_INODE_DIR) {
+        pthread_mutex_unlock(INODE_LOCK(index));
+        journal_end(fs);
+        SFS_ERROR(SFS_EISDIR, "sfs_delet_file error: inode is a directory");
+    }
+    
+    delete_inode(fs, index);
+    
+    pthread_mutex_unlock(INODE_LOCK(index));
+    
+    journal_end(fs);
+    
+    return SFS_OK;
+}
+
+//returns file size, buffered appends included
+u64  sfs_file_size (sfs_file* file) {
+    return file->node.size + file->append_buffered;
+}
+
+//set file data pointer
+void sfs_file_seek (sfs_file* file, u64 offset) {
+    file->data_pointer = offset;
+}
+
+//read file data pointer
+u64 sfs_file_tell (sfs_file* file) {
+    return file->data_pointer;
+}
+
+/*ASYNC I/O*/
+
+//serves queued requests until the workers are stopped and the queue is empty
+static void* async_worker(void* arg) {
+    
+    SFS* fs = arg;
+    
+    pthread_mutex_lock(&fs->async_lock);
+    
+    while(1) {
+        
+        while(fs->async_head == NULL && !fs->async_stop) {
+            pthread_cond_wait(&fs->async_queued, &fs->async_lock);
+        }
+        
+        if(fs->async_head == NULL) { break; }
+        
+        sfs_request* request = fs->async_head;
+        
+        fs->async_head = request->next;
+        
+        if(fs->async_head == NULL) {
+            fs->async_tail = NULL;
+        }
+        
+        pthread_mutex_unlock(&fs->async_lock);
+        
+        //error of an earlier request of this worker must not be reported for this one
+        sfs_clear_error();
+        
+        if(request->write) {
+            request->result = sfs_pwrite(request->file, request->buffer, request->size, request->offset);
+        } else {
+            request->result = sfs_pread(request->file, request->buffer, request->size, request->offset);
+        }
+        
+        request->status = (request->result != request->size) ? sfs_last_error() : SFS_OK;
+        
+        if(request->callback != NULL) {
+            request->callback(request);
+        }
+        
+        pthread_mutex_lock(&fs->async_lock);
+        
+        //caller may free the request as soon as it is done
+        request->done = 1;
+        
+        fs->async_in_flight--;
+        STAT_COUNT(fs->async_counters.completed, 1);
+        
+        pthread_cond_broadcast(&fs->async_finished);
+    }
+    
+    pthread_mutex_unlock(&fs->async_lock);
+    
+    return NULL;
+}
+
+//waits for all requests and joins the workers
+static void async_shutdown(SFS* fs) {
+    
+    pthread_mutex_lock(&fs->async_lock);
+    
+    fs->async_stop = 1;
+    
+    pthread_cond_broadcast(&fs->async_queued);
+    
+    pthread_mutex_unlock(&fs->async_lock);
+    
+    for(u32 i = 0; i < fs->async_threads_num; i++) {
+        pthread_join(fs->async_threads[i], NULL);
+    }
+    
+    fs->async_threads_num = 0;
+}
+
+//queues the request, workers are started with the first one
+static void async_submit(sfs_file* file, void* buffer, u32 size, u64 offset, bool write, sfs_request* request, sfs_callback callback, void* user_data) {
+    
+    SFS* fs = file->fs;
+    
+    request->fs        = fs;
+    request->file      = file;
+    request->buffer    = buffer;
+    request->size      = size;
+    request->offset    = offset;
+    request->write     = write;
+    request->result    = 0;
+    request->status    = SFS_OK;
+    request->done      = 0;
+    request->callback  = callback;
+    request->user_data = user_data;
+    request->next      = NULL;
+    
+    //reads of one handle running together only look at its extents
+    sfs_flush_file(file);
+    load_extents(file);
+    
+    pthread_mutex_lock(&fs->async_lock);
+    
+    if(fs->async_in_flight >= fs->async_depth) {
+        
+        STAT_COUNT(fs->async_counters.full_waits, 1);
+        
+        while(fs->async_in_flight >= fs->async_depth) {
+            pthread_cond_wait(&fs->async_finished, &fs->async_lock);
+        }
+    }
+    
+    while(fs->async_threads_num < SFS_ASYNC_THREADS) {
+        pthread_create(&fs->async_threads[fs->async_threads_num++], NULL, async_worker, fs);
+    }
+    
+    if(fs->async_tail == NULL) {
+        fs->async_head = request;
+    } else {
+        fs->async_tail->next = request;
+    }
+    
+    fs->async_tail = request;
+    
+    fs->async_in_flight++;
+    STAT_COUNT(fs->async_counters.submitted, 1);
+    
+    if(fs->async_in_flight > fs->async_counters.max_in_flight) {
+        fs->async_counters.max_in_flight = fs->async_in_flight;
+    }
+    
+    pthread_cond_signal(&fs->async_queued);
+    
+    pthread_mutex_unlock(&fs->async_lock);
+}
+
+void sfs_pread_async(sfs_file* file, void* buffer, u32 size, u64 offset, sfs_request* request, sfs_callback callback, void* user_data) {
+    async_submit(file, buffer, size, offset, false, request, callback, user_data);
+}
+
+void sfs_pwrite_async(sfs_file* file, void* buffer, u32 size, u64 offset, sfs_request* request, sfs_callback callback, void* user_data) {
+    async_submit(file, buffer, size, offset, true, request, callback, user_data);
+}
+
+bool sfs_request_done(sfs_request* request) {
+    
+    SFS* fs = request->fs;
+    
+    pthread_mutex_lock(&fs->async_lock);
+    
+    bool done = request->done;
+    
+    pthread_mutex_unlock(&fs->async_lock);
+    
+    return done;
+}
+
+u32 sfs_wait_request(sfs_request* request) {
+    
+    SFS* fs = request->fs;
+    
+    pthread_mutex_lock(&fs->async_lock);
+    
+    while(!request->done) {
+        pthread_cond_wait(&fs->async_finished, &fs->async_lock);
+    }
+    
+    pthread_mutex_unlock(&fs->async_lock);
+    
+    return request->result;
+}
+
+void sfs_set_queue_depth(SFS* fs, u32 depth) {
+    
+    pthread_mutex_lock(&fs->async_lock);
+    
+    fs->async_depth = (depth == 0) ? 1 : depth;
+    
+    fs->async_counters.queue_depth = fs->async_depth;
+    
+    //deeper queue lets waiting submissions go on
+    pthread_cond_broadcast(&fs->async_finished);
+    
+    pthread_mutex_unlock(&fs->async_lock);
+}
+
+void get_async_stats(SFS* fs, async_stats* stats) {
+    
+    pthread_mutex_lock(&fs->async_lock);
+    
+    *stats = fs->async_counters;
+    
+    pthread_mutex_unlock(&fs->async_lock);
+}
+
+
+
+/*STATISTICS*/
+
+void sfs_get_stats(SFS* fs, sfs_stats* stats) {
+    
+    get_cache_stats(fs, &stats->cache);
+    get_io_stats(fs, &stats->io);
+    get_memory_stats(fs, &stats->memory);
+    get_async_stats(fs, &stats->async);
+    
+    stat_copy(&stats->ops,           &fs->op_counters,   sizeof(op_stats));
+    stat_copy(&stats->read_latency,  &fs->read_latency,  sizeof(latency_histogram));
+    stat_copy(&stats->write_latency, &fs->write_latency, sizeof(latency_histogram));
+    stat_copy(&stats->open_latency,  &fs->open_latency,  sizeof(latency_histogram));
+    stat_copy(&stats->mount_latency, &fs->mount_latency, sizeof(latency_histogram));
+}
+
+u64 sfs_latency_percentile(latency_histogram* histogram, u32 percent) {
+    
+    if(histogram->count == 0) { return 0; }
+    
+    //calls up to the percentile, at least one
+    u64 rank = (histogram->count * percent + 99) / 100;
+    u64 seen = 0;
+    
+    for(u32 i = 0; i < SFS_HISTOGRAM_BUCKETS - 1; i++) {
+        
+        seen += histogram->buckets[i];
+        
+        if(seen >= rank && seen != 0) {
+            return ((2ULL << i) - 1 < histogram->max_ns) ? (2ULL << i) - 1 : histogram->max_ns;
+        }
+    }
+    
+    return histogram->max_ns;
+}
+
+static void dump_latency(FILE* out, char* name, latency_histogram* histogram) {
+    
+    fprintf(out, "sfs %-5s latency: %llu calls, mean %llu ns, p50 %llu ns, p99 %llu ns, max %llu ns\n", name, histogram->count,
+            (histogram->count != 0) ? histogram->total_ns / histogram->count : 0,
+            sfs_latency_percentile(histogram, 50), sfs_latency_percentile(histogram, 99), histogram->max_ns);
+}
+
+void sfs_dump_stats(SFS* fs, FILE* out) {
+    
+    sfs_stats stats;
+    
+    sfs_get_stats(fs, &stats);
+    
+    fprintf(out, "sfs io: %llu reads, %llu writes, %llu syncs, %llu bytes read, %llu bytes written\n",
+            stats.io.reads, stats.io.writes, stats.io.syncs, stats.io.bytes_read, stats.io.bytes_written);
+    fprintf(out, "sfs blocks: %llu read, %llu written, %llu bytes copied\n",
+            stats.ops.blocks_read, stats.ops.blocks_written, stats.ops.bytes_copied);
+    fprintf(out, "sfs cache: %llu hits, %llu misses, %llu evictions, %llu writebacks, %llu read ahead\n",
+            stats.cache.hits, stats.cache.misses, stats.cache.evictions, stats.cache.writebacks, stats.cache.readahead);
+    fprintf(out, "sfs allocator: %llu searches, %llu bitmap words scanned\n", stats.ops.alloc_searches, stats.ops.alloc_scanned);
+    fprintf(out, "sfs inodes: %llu reads, %llu writes\n", stats.ops.inode_reads, stats.ops.inode_writes);
+    fprintf(out, "sfs memory: %llu allocations, %llu handles reused\n", stats.memory.allocations, stats.memory.handles_reused);
+    fprintf(out, "sfs async: %llu submitted, %llu completed, %llu full waits\n",
+            stats.async.submitted, stats.async.completed, stats.async.full_waits);
+    
+    dump_latency(out, "read",  &stats.read_latency);
+    dump_latency(out, "write", &stats.write_latency);
+    dump_latency(out, "open",  &stats.open_latency);
+    dump_latency(out, "mount", &stats.mount_latency);
+    
+    fflush(out);
+}
+
+//dumps stats every interval until the interval is set to 0
+static void* stats_worker(void* arg) {
+    
+    SFS* fs = arg;
+    
+    pthread_mutex_lock(&fs->stats_lock);
+    
+    while(fs->stats_interval != 0) {
+        
+        struct timespec deadline;
+        
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        
+        u64 ns = deadline.tv_nsec + (u64)fs->stats_interval * 1000000;
+        
+        deadline.tv_sec += ns / 1000000000;
+        deadline.tv_nsec = ns % 1000000000;
+        
+        //settings changed, the interval starts over
+        if(pthread_cond_timedwait(&fs->stats_wake, &fs->stats_lock, &deadline) != ETIMEDOUT) { continue; }
+        
+        sfs_dump_stats(fs, fs->stats_out);
+    }
+    
+    pthread_mutex_unlock(&fs->stats_lock);
+    
+    return NULL;
+}
+
+void sfs_set_stats_dump(SFS* fs, FILE* out, u32 interval_ms) {
+    
+    pthread_mutex_lock(&fs->stats_lock);
+    
+    bool running = fs->stats_interval != 0;
+    
+    fs->stats_out      = out;
+    fs->stats_interval = interval_ms;
+    
+    if(!running && interval_ms != 0 && pthread_create(&fs->stats_thread, NULL, stats_worker, fs) != 0) {
+        fs->stats_interval = 0;
+    }
+    
+    pthread_cond_signal(&fs->stats_wake);
+    
+    pthread_mutex_unlock(&fs->stats_lock);
+    
+    if(running && interval_ms == 0) {
+        pthread_join(fs->stats_thread, NULL);
+    }
+}
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+/*DIRECTORY IMPLEMENTATION*/
+
+//first slot of the directory table
+typedef struct dir_header {
+    u32 entries; //live entries
+    u32 used;    //live and deleted entries, deleted ones keep probe chains intact
+    u8  unused[sizeof(dir_entry) - 2 * sizeof(u32)];
+} dir_header;
+
+//FNV-1a
+static u32 hash_name(char* name) {
+    
+    u32 hash = 2166136261U;
+    
+    for(; *name != 0; name++) {
+        hash = (hash ^ (u8)*name) * 16777619U;
+    }
+    
+    return hash;
+}
+
+//opens directory handle with loaded extents, directory inode lock must be held
+static sfs_file* open_dir_handle(SFS* fs, u32 index) {
+    
+    inode node;
+    
+    if(!read_inode(fs, index, &node)) { return NULL; }
+    
+    if(node.valid != SFS_INODE_DIR) { SFS_NULL_ERROR(SFS_ENOTDIR, "sfs directory error: inode is not a directory"); }
+    
+    sfs_file* dir = new_handle(fs, index, &node);
+    
+    if(!load_extents(dir)) {
+        release_handle(dir);
+        return NULL;
+    }
+    
+    return dir;
+}
+
+static void close_dir_handle(sfs_file* dir) {
+    
+    flush_extents(dir);
+    release_handle(dir);
+}
+
+static u32 dir_capacity(sfs_file* dir) {
+    return dir->node.size / sizeof(dir_entry);
+}
+
+//directory tables are metadata, their blocks are read and written through the journal
+static u32 dir_slot_block(sfs_file* dir, u32 slot) {
+    
+    SFS* fs = dir->fs;
+    u32  run;
+    
+    return map_file_block(dir, slot / DIR_MIN_SLOTS, &run);
+}
+
+static void dir_read_slot(sfs_file* dir, u32 slot, void* entry) {
+    
+    SFS* fs = dir->fs;
+    
+    read_metadata(fs, dir_slot_block(dir, slot), (slot % DIR_MIN_SLOTS) * sizeof(dir_entry), entry, sizeof(dir_entry));
+}
+
+static bool dir_write_slot(sfs_file* dir, u32 slot, void* entry) {
+    
+    SFS* fs = dir->fs;
+    
+    char block[SFS_MAX_BLOCK_SIZE];
+    u32  block_index = dir_slot_block(dir, slot);
+    
+    //rest of the block would be lost
+    if(!read_metadata(fs, block_index, 0, block, FS_BLOCK_SIZE)) { return false; }
+    
+    memcpy(block + (slot % DIR_MIN_SLOTS) * sizeof(dir_entry), entry, sizeof(dir_entry));
+    
+    return journal_add(fs, block_index, block);
+}
 
+//finds name in the directory with linear probing, returns its slot, 0 if it is not there
+//free_slot - first slot the name can be inserted to, 0 if there is none
+static u32 dir_find(sfs_file* dir, char* name, u32 hash, dir_entry* entry, u32* free_slot) {
+    
+    u32 capacity = dir_capacity(dir);
+    
+    *free_slot = 0;
+    
+    for(u32 probe = 0; probe < capacity; probe++) {
+        
+        u32 slot = (hash + probe) % capacity;
+        
+        //header
+        if(slot == 0) { continue; }
+        
+        dir_read_slot(dir, slot, entry);
+        
+        if(entry->inumber == DIR_SLOT_EMPTY || entry->inumber == DIR_SLOT_DELETED) {
+            
+            if(*free_slot == 0) {
+                *free_slot = slot;
+            }
+            
+            //end of the probe chain
+            if(entry->inumber == DIR_SLOT_EMPTY) { return 0; }
+            
+            continue;
+        }
+        
+        if(entry->hash == hash && strcmp(entry->name, name) == 0) {
+            return slot;
+        }
+    }
+    
+    return 0;
+}
 
+//rebuilds the table with room for at least twice the live entries, deleted slots are dropped
+static bool dir_rehash(sfs_file* dir, dir_header* header) {
+    
+    SFS* fs = dir->fs;
+    
+    u32 capacity     = dir_capacity(dir);
+    u32 new_capacity = DIR_MIN_SLOTS;
+    
+    while((u64)(header->entries + 1) * 2 > new_capacity - 1) {
+        new_capacity *= 2;
+    }
+    
+    dir_entry* old_table = fs_malloc(fs, (u64)capacity * sizeof(dir_entry));
+    dir_entry* new_table = fs_calloc(fs, new_capacity, sizeof(dir_entry));
+    
+    if((capacity != 0 && old_table == NULL) || new_table == NULL) {
+        free(old_table);
+        free(new_table);
+        SFS_ZERO_ERROR(SFS_ENOMEM, "sfs directory error: out of memory");
+    }
+    
+    for(u32 i = 0; i < capacity; i += DIR_MIN_SLOTS) {
+        
+        if(!read_metadata(fs, dir_slot_block(dir, i), 0, old_table + i, FS_BLOCK_SIZE)) {
+            free(old_table);
+            free(new_table);
+            return false;
+        }
+    }
+    
+    for(u32 i = 1; i < capacity; i++) {
+        
+        if(old_table[i].inumber == DIR_SLOT_EMPTY || old_table[i].inumber == DIR_SLOT_DELETED) { continue; }
+        
+        u32 slot = old_table[i].hash % new_capacity;
+        
+        while(slot == 0 || new_table[slot].inumber != DIR_SLOT_EMPTY) {
+            slot = (slot + 1) % new_capacity;
+        }
+        
+        new_table[slot] = old_table[i];
+    }
+    
+    header->used = header->entries;
+    
+    memcpy(&new_table[0], header, sizeof(dir_header));
+    
+    //replace the data of the directory, old blocks are released only once the new table is written
+    inode old_node = dir->node;
+    inode node     = { SFS_INODE_DIR };
+    
+    reset_handle(dir, &node);
+    
+    u32 bytes   = new_capacity * sizeof(dir_entry);
+    u32 written = load_extents(dir) ? append_file(dir, new_table, bytes) : 0;
+    
+    free(old_table);
+    free(new_table);
+    
+    //disk is full or the journal cannot take the new extents, keep the old table
+    if(written != bytes || !flush_extents(dir)) {
+        
+        flush_extents(dir);
+        release_inode_blocks(fs, &dir->node);
+        
+        reset_handle(dir, &old_node);
+        
+        write_inode(fs, dir->inumber, &old_node);
+        load_extents(dir);
+        
+        return false;
+    }
+    
+    release_inode_blocks(fs, &old_node);
+    
+    return true;
+}
 
+//adds entry to the directory, name must not be there yet, directory inode lock must be held
+static bool dir_insert(sfs_file* dir, char* name, u32 inumber) {
+    
+    dir_header header = { 0 };
+    
+    if(dir_capacity(dir) != 0) {
+        dir_read_slot(dir, 0, &header);
+    }
+    
+    //keep the table at most three quarters full
+    if(dir_capacity(dir) == 0 || (u64)(header.used + 1) * 4 > (u64)(dir_capacity(dir) - 1) * 3) {
+        
+        if(!dir_rehash(dir, &header)) { return false; }
+    }
+    
+    dir_entry entry;
+    u32       slot;
+    
+    dir_find(dir, name, hash_name(name), &entry, &slot);
+    
+    //reusing a deleted slot does not lengthen probe chains
+    dir_read_slot(dir, slot, &entry);
+    
+    dir_entry old_entry = entry;
+    
+    if(entry.inumber == DIR_SLOT_EMPTY) {
+        header.used++;
+    }
+    
+    header.entries++;
+    
+    memset(&entry, 0, sizeof(dir_entry));
+    
+    entry.inumber = inumber;
+    entry.hash    = hash_name(name);
+    
+    strcpy(entry.name, name);
+    
+    if(!dir_write_slot(dir, slot, &entry)) { return false; }
+    
+    //block of the entry is in the journal now, putting the old entry back only replaces its image
+    if(!dir_write_slot(dir, 0, &header)) {
+        dir_write_slot(dir, slot, &old_entry);
+        return false;
+    }
+    
+    return true;
+}
 
+//looks name up in the directory, returns its inode, 0 if it is not there
+static u32 dir_lookup(SFS* fs, u32 dir_index, char* name) {
+    
+    pthread_mutex_lock(INODE_LOCK(dir_index));
+    
+    sfs_file* dir = open_dir_handle(fs, dir_index);
+    
+    u32 inumber = 0;
+    
+    if(dir != NULL) {
+        
+        dir_entry entry;
+        u32       free_slot;
+        
+        if(dir_find(dir, name, hash_name(name), &entry, &free_slot) != 0) {
+            inumber = entry.inumber;
+        }
+        
+        close_dir_handle(dir);
+    }
+    
+    pthread_mutex_unlock(INODE_LOCK(dir_index));
+    
+    return inumber;
+}
 
+//walks the path to the directory holding its last component
+//parent - inode of that directory, name - the last component
+static bool resolve_parent(SFS* fs, char* path, u32* parent, char* name) {
+    
+    u32 dir = SFS_ROOT_INODE;
+    
+    while(1) {
+        
+        while(*path == '/') { path++; }
+        
+        u32 length = strcspn(path, "/");
+        
+        if(length == 0) { SFS_ZERO_ERROR(SFS_EINVAL, "sfs path error: path has no name"); }
+        
+        if(length >= SFS_NAME_LENGTH) { SFS_ZERO_ERROR(SFS_ENAMETOOLONG, "sfs path error: name is too long"); }
+        
+        memcpy(name, path, length);
+        
+        name[length] = 0;
+        
+        path += length;
+        
+        while(*path == '/') { path++; }
+        
+        //last component
+        if(*path == 0) {
+            *parent = dir;
+            return true;
+        }
+        
+        dir = dir_lookup(fs, dir, name);
+        
+        if(dir == 0) { SFS_ZERO_ERROR(SFS_ENOENT, "sfs path error: directory doesn't exist"); }
+    }
+}
 
+//returns free inode marked as used with type, 0 if there is none or the inode table cannot be read
+static u32 alloc_inode(SFS* fs, u32 type) {
+    
+    pthread_mutex_lock(&fs->inode_table_lock);
+    
+    for(u32 i = 0; i < fs->inodes; i++) {
+        
+        u32 index = (fs->inode_cursor + i) % fs->inodes;
+        u32 page  = index / INODES_PER_BLOCK;
+        
+        inode* nodes = inode_page(fs, page);
+        
+        if(nodes == NULL) {
+            pthread_mutex_unlock(&fs->inode_table_lock);
+            return 0;
+        }
+        
+        inode* node = &nodes[index % INODES_PER_BLOCK];
+        
+        if(!node->valid) {
+            
+            memset(node, 0, sizeof(inode));
+            
+            node->valid = type;
+            
+            mark_inode_page(fs, page);
+            
+            fs->inode_cursor = index + 1;
+            
+            pthread_mutex_unlock(&fs->inode_table_lock);
+            
+            return index;
+        }
+    }
+    
+    pthread_mutex_unlock(&fs->inode_table_lock);
+    
+    SFS_ZERO_ERROR(SFS_ENOSPC, "sfs path error: out of inodes");
+}
 
+static u32 link_path_section(SFS* fs, char* path, u32 type, bool create, bool* created) {
+    
+    u32  parent;
+    char name[SFS_NAME_LENGTH];
+    
+    *created = false;
+    
+    if(!resolve_parent(fs, path, &parent, name)) { return 0; }
+    
+    journal_begin(fs);
+    
+    pthread_mutex_lock(INODE_LOCK(parent));
+    
+    sfs_file* dir = open_dir_handle(fs, parent);
+    
+    if(dir == NULL) {
+        pthread_mutex_unlock(INODE_LOCK(parent));
+        journal_end(fs);
+        return 0;
+    }
+    
+    dir_entry entry;
+    u32       free_slot;
+    u32       inumber = 0;
+    
+    if(dir_find(dir, name, hash_name(name), &entry, &free_slot) != 0) {
+        
+        inumber = entry.inumber;
+        
+    } else if(create) {
+        
+        inumber = alloc_inode(fs, type);
+        
+        //inode is freed again when the name cannot be inserted
+        if(inumber != 0 && !dir_insert(dir, name, inumber)) {
+            
+            inode node = { 0 };
+            
+            write_inode(fs, inumber, &node);
+            
+            inumber = 0;
+        }
+        
+        *created = inumber != 0;
+    }
+    
+    close_dir_handle(dir);
+    
+    pthread_mutex_unlock(INODE_LOCK(parent));
+    
+    journal_end(fs);
+    
+    return inumber;
+}
 
+//creates inode of type and links it into the directory, returns existing inode if create is false or the name exists
+static u32 link_path(SFS* fs, char* path, u32 type, bool create, bool* created) {
+    
+    u32 inumber = link_path_section(fs, path, type, create, created);
+    
+    //directory table may need blocks freed since the last commit
+    if(inumber == 0 && create && commit_frees(fs)) {
+        inumber = link_path_section(fs, path, type, create, created);
+    }
+    
+    return inumber;
+}
 
+//opens file by path
+sfs_file* sfs_open_path(SFS* fs, char* path, u8 mode) {
+    
+    bool created;
+    
+    u32 inumber = link_path(fs, path, SFS_INODE_FILE, mode == SFS_MODE_WRITE, &created);
+    
+    //creation failures are already recorded
+    if(inumber == 0 && mode == SFS_MODE_WRITE) { return NULL; }
+    
+    if(inumber == 0) { SFS_NULL_ERROR(SFS_ENOENT, "sfs_open_path error: file doesn't exist"); }
+    
+    STAT_TIMER(start);
+    
+    //file unlinked since the lookup is not created again, it would be unreachable
+    sfs_file* file = open_file(fs, inumber, mode, false);
+    
+    STAT_LATENCY(fs->open_latency, start);
+    
+    return file;
+}
 
+//creates directory
+u32 sfs_mkdir(SFS* fs, char* path) {
+    
+    bool created;
+    
+    u32 inumber = link_path(fs, path, SFS_INODE_DIR, true, &created);
+    
+    if(inumber != 0 && !created) { SFS_ZERO_ERROR(SFS_EEXIST, "sfs_mkdir error: name already exists"); }
+    
+    return inumber;
+}
 
+//locks inode locks of two inodes, locks are always taken in the order of their addresses
+//both inodes may share one lock
+static void lock_inode_pair(SFS* fs, u32 a, u32 b) {
+    
+    pthread_mutex_t* first  = INODE_LOCK(a);
+    pthread_mutex_t* second = INODE_LOCK(b);
+    
+    if(first > second) {
+        first  = INODE_LOCK(b);
+        second = INODE_LOCK(a);
+    }
+    
+    pthread_mutex_lock(first);
+    
+    if(second != first) {
+        pthread_mutex_lock(second);
+    }
+}
 
+static void unlock_inode_pair(SFS* fs, u32 a, u32 b) {
+    
+    if(INODE_LOCK(a) != INODE_LOCK(b)) {
+        pthread_mutex_unlock(INODE_LOCK(b));
+    }
+    
+    pthread_mutex_unlock(INODE_LOCK(a));
+}
 
+//removes file or empty directory
+//entry and inode are removed in one journal section, a crash never leaves the inode unreachable
+u32 sfs_unlink(SFS* fs, char* path) {
+    
+    u32  parent;
+    char name[SFS_NAME_LENGTH];
+    
+    if(!resolve_parent(fs, path, &parent, name)) { return 0; }
+    
+    sfs_file* dir;
+    dir_entry entry;
+    u32       slot;
+    
+    //child is found first so both locks can be taken in order, the entry is checked again under them
+    for(u32 inumber = dir_lookup(fs, parent, name); ; inumber = entry.inumber) {
+        
+        if(inumber == 0) { SFS_ZERO_ERROR(SFS_ENOENT, "sfs_unlink error: file doesn't exist"); }
+        
+        journal_begin(fs);
+        
+        lock_inode_pair(fs, parent, inumber);
+        
+        dir = open_dir_handle(fs, parent);
+        
+        if(dir == NULL) {
+            unlock_inode_pair(fs, parent, inumber);
+            journal_end(fs);
+            return 0;
+        }
+        
+        u32 free_slot;
+        
+        slot = dir_find(dir, name, hash_name(name), &entry, &free_slot);
+        
+        if(slot != 0 && entry.inumber == inumber) { break; }
+        
+        //name was removed or linked again meanwhile
+        close_dir_handle(dir);
+        
+        unlock_inode_pair(fs, parent, inumber);
+        
+        journal_end(fs);
+        
+        if(slot == 0) { entry.inumber = 0; }
+    }
+    
+    u32 inumber = entry.inumber;
+    
+    inode node;
+    
+    if(!read_inode(fs, inumber, &node)) {
+        close_dir_handle(dir);
+        unlock_inode_pair(fs, parent, inumber);
+        journal_end(fs);
+        return 0;
+    }
+    
+    dir_header child = { 0 };
+    
+    //directory table is read only when the directory has one
+    if(node.valid == SFS_INODE_DIR && node.size != 0) {
+        
+        sfs_file* child_dir = new_handle(fs, inumber, &node);
+        
+        if(load_extents(child_dir)) {
+            dir_read_slot(child_dir, 0, &child);
+        }
+        
+        release_handle(child_dir);
+    }
+    
+    if(child.entries != 0) {
+        
+        close_dir_handle(dir);
+        
+        unlock_inode_pair(fs, parent, inumber);
+        
+        journal_end(fs);
+        
+        SFS_ZERO_ERROR(SFS_ENOTEMPTY, "sfs_unlink error: directory is not empty");
+    }
+    
+    //deleted slot keeps probe chains going through it
+    dir_header header;
+    
+    dir_read_slot(dir, 0, &header);
+    
+    header.entries--;
+    
+    dir_entry old_entry = entry;
+    
+    entry.inumber = DIR_SLOT_DELETED;
+    
+    bool removed = dir_write_slot(dir, slot, &entry);
+    
+    //block of the entry is in the journal now, putting the old entry back only replaces its image
+    if(removed && !dir_write_slot(dir, 0, &header)) {
+        dir_write_slot(dir, slot, &old_entry);
+        removed = false;
+    }
+    
+    close_dir_handle(dir);
+    
+    if(!removed) {
+        unlock_inode_pair(fs, parent, inumber);
+        journal_end(fs);
+        return 0;
+    }
+    
+    delete_inode(fs, inumber);
+    
+    unlock_inode_pair(fs, parent, inumber);
+    
+    journal_end(fs);
+    
+    return 1;
+}
 
+//opens directory for reading its entries
+sfs_file* sfs_opendir(SFS* fs, char* path) {
+    
+    u32 inumber = SFS_ROOT_INODE;
+    
+    //root has no name
+    if(path[strspn(path, "/")] != 0) {
+        
+        bool created;
+        
+        inumber = link_path(fs, path, SFS_INODE_DIR, false, &created);
+        
+        if(inumber == 0) { SFS_NULL_ERROR(SFS_ENOENT, "sfs_opendir error: directory doesn't exist"); }
+    }
+    
+    pthread_mutex_lock(INODE_LOCK(inumber));
+    
+    sfs_file* dir = open_dir_handle(fs, inumber);
+    
+    pthread_mutex_unlock(INODE_LOCK(inumber));
+    
+    if(dir != NULL) {
+        dir->data_pointer = sizeof(dir_entry);
+    }
+    
+    return dir;
+}
 
-
-
-
-
-
-
-
+//reads next entry of the directory, data pointer is used as the cursor
+u32 sfs_readdir(sfs_file* dir, dir_entry* entry) {
+    
+    while(dir->data_pointer < dir->node.size) {
+        
+        dir_read_slot(dir, dir->data_pointer / sizeof(dir_entry), entry);
+        
+        dir->data_pointer += sizeof(dir_entry);
+        
+        if(entry->inumber != DIR_SLOT_EMPTY && entry->inumber != DIR_SLOT_DELETED) {
+            return 1;
+        }
+    }
+    
+    return 0;
+}
@@ -3,81 +3,477 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <math.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
 
-#define BLOCK_SIZE             0x1000
+#define BLOCK_SIZE             0x1000     //default block size, format_sfs can choose another one
+#define SFS_MIN_BLOCK_SIZE     0x400
+#define SFS_MAX_BLOCK_SIZE     0x10000
+#define SFS_BYTES_PER_INODE    640        //default, inode table takes 10% of the disk
 #define MAGIC_NUMBER           0xf0f03410
+#define SFS_VERSION            7          //1 - direct/indirect pointers (reads as 0), 2 - extents, 3 - on-disk free block bitmap, 4 - directories, 5 - metadata journal, 6 - 64-bit file sizes, 7 - block size and inode ratio in the header
 
 #define GET_BIT(x,y)           ((x>>y)&1U)
 #define SET_BIT(x,y,z)         x^=(-!!z^x)&(1U<<y)
 
-#define MAX_FILE_SIZE		   (5*BLOCK_SIZE+1024*BLOCK_SIZE)
+#define GET_BIT64(x,y)         ((x>>(y))&1ULL)
+#define SET_BIT64(x,y,z)       x^=(-(u64)!!(z)^x)&(1ULL<<(y))
+
+#define BITMAP_WORD_BITS       64
+
+#define MAX_FILE_SIZE(fs)      (0xffffffffULL * (fs)->block_size) //file block indexes are 32-bit like disk block indexes
+
+#define INLINE_EXTENTS         5                                   //extents stored in the inode itself, they fill it to 64 bytes
+
+#define SFS_INODE_FILE         1
+#define SFS_INODE_DIR          2
+
+#define SFS_ROOT_INODE         0  //root directory, created by format_sfs
+#define SFS_NAME_LENGTH        56 //longest name in a directory including the terminating zero
 
 #define SFS_MODE_READ          0
 #define SFS_MODE_WRITE         1
 
+#define SFS_IO_STDIO           0 //blocks are accessed with pread/pwrite on the disk file through the block cache
+#define SFS_IO_MMAP            1 //whole disk is mapped into memory, blocks are accessed in place
+
+#define SFS_FORMAT_ZERO        0 //every block is written with zeros
+#define SFS_FORMAT_SPARSE      1 //only the header is written, rest of the disk is a hole in a sparse file
+#define SFS_FORMAT_PREALLOCATE 2 //like SFS_FORMAT_SPARSE, space for the whole disk is reserved with fallocate
+
+//number of locks shared by inodes, updates of one inode are serialized
+#ifndef SFS_INODE_LOCKS
+#define SFS_INODE_LOCKS        64
+#endif
+
+//number of threads scanning the inode table at mount after unclean shutdown and in fsck
+#ifndef SFS_SCAN_THREADS
+#define SFS_SCAN_THREADS       4
+#endif
+
+//number of blocks kept in the write-back block cache
+#ifndef SFS_CACHE_BLOCKS
+#define SFS_CACHE_BLOCKS       64
+#endif
+
+//most blocks read ahead of sequential small sfs_read_file calls, at most half of the block cache is used
+#ifndef SFS_READAHEAD_BLOCKS
+#define SFS_READAHEAD_BLOCKS   (SFS_CACHE_BLOCKS / 2)
+#endif
+
+//most bytes of small appends collected by a handle before they are written
+#ifndef SFS_APPEND_BUFFER
+#define SFS_APPEND_BUFFER      (64 * BLOCK_SIZE)
+#endif
+
+//number of closed file handles kept for reuse with their arrays
+#ifndef SFS_HANDLE_POOL
+#define SFS_HANDLE_POOL        32
+#endif
+
+//number of threads serving asynchronous requests, they are started by the first request
+#ifndef SFS_ASYNC_THREADS
+#define SFS_ASYNC_THREADS      4
+#endif
+
+//default number of asynchronous requests in flight, change it with sfs_set_queue_depth
+#ifndef SFS_QUEUE_DEPTH
+#define SFS_QUEUE_DEPTH        64
+#endif
+
+//counters and latency histograms, 0 compiles the instrumentation out, stats then read as zeros
+#ifndef SFS_STATS
+#define SFS_STATS              1
+#endif
+
+//most messages passed to the log callback in one second, the rest are dropped
+#ifndef SFS_LOG_RATE
+#define SFS_LOG_RATE           10
+#endif
+
+#define SFS_HISTOGRAM_BUCKETS  36 //bucket i counts calls taking [2^i, 2^(i+1)) ns, the last one also slower calls
+
 typedef unsigned char  u8;
 typedef unsigned short u16;
 typedef unsigned int   u32;
+typedef unsigned long long u64;
+
+/*ERRORS*/
+
+//failed calls return 0, NULL or the status and leave the status in the calling thread's last error
+//successful calls do not clear it, block 0 holds the header and is never returned as a free block
+
+typedef enum sfs_status {
+    SFS_OK = 0,
+    SFS_EINVAL,       //argument out of range
+    SFS_ENOENT,       //file or directory doesn't exist
+    SFS_EEXIST,       //name already exists
+    SFS_EISDIR,       //file operation on a directory
+    SFS_ENOTDIR,      //directory operation on a file
+    SFS_ENOTEMPTY,    //directory still has entries
+    SFS_ENAMETOOLONG, //name longer than SFS_NAME_LENGTH - 1
+    SFS_ENOSPC,       //no free blocks or inodes left
+    SFS_ENOMEM,       //host out of memory
+    SFS_EIO,          //emulated drive cannot be opened, read, written or mapped
+    SFS_EFORMAT,      //emulated drive is not formatted with this version
+    SFS_EFBIG,        //file would grow past MAX_FILE_SIZE
+    SFS_ECORRUPT,     //problem found by fsck_sfs, only passed to the log callback
+} sfs_status;
+
+//called for failed calls and problems found by fsck_sfs, at most SFS_LOG_RATE times a second, from the failing or scanning thread
+typedef void (*sfs_log_callback)(sfs_status status, const char* message, void* user_data);
+
+sfs_status  sfs_last_error(void);  //status of the last failed call of this thread, SFS_OK if none failed yet
+void        sfs_clear_error(void);
+const char* sfs_strerror(sfs_status status);
+
+void sfs_set_log_callback(sfs_log_callback callback, void* user_data); //NULL turns logging off, it is off by default
+
+
 
 /*DISK IMPLEMENTATION*/
 
-//init with init_sfs
-char* g_free_block_bitmap;
+typedef struct extent {
+    u32 start;       //first block of the run
+    u32 length;      //number of contiguous blocks
+} extent;
+
+//extents and the chain hold block indexes, byte offsets are only computed in 64 bits
+typedef struct inode {
+    u32    valid;                  //SFS_INODE_FILE or SFS_INODE_DIR - has been created, 0 - not
+    u32    extents_num;            //number of extents used by the file
+    u64    size;                   //size of data in inode
+    u32    indirect;               //block index of first block of the extent chain, holds extents past the inline ones
+    u32    reserved;
+    extent direct[INLINE_EXTENTS]; //first extents of the file
+} inode;
+
+//directory is a hash table of entries stored as its data, first slot holds the table header
+typedef struct dir_entry {
+    u32  inumber;               //0 - empty slot, root directory is never an entry
+    u32  hash;                  //hash of the name
+    char name[SFS_NAME_LENGTH];
+} dir_entry;
+
+typedef struct cache_block {
+    u32   block_index; //index of cached block on disk
+    u8    valid;       //1 - holds block data, 0 - empty slot
+    u8    dirty;       //1 - modified, must be written back before eviction
+    u8    referenced;  //clock bit, cleared when the clock hand passes
+    int   next;        //next slot in the same hash bucket, -1 ends the chain
+    char* data;
+} cache_block;
+
+typedef struct cache_stats {
+    u64 hits;
+    u64 misses;
+    u64 evictions;  //valid blocks thrown out to make room
+    u64 writebacks; //dirty blocks written to disk
+    u64 readahead;  //blocks loaded ahead of sequential reads
+} cache_stats;
+
+typedef struct io_stats {
+    u64 reads;         //read system calls issued (pread, preadv), positioned I/O needs no seeks
+    u64 writes;        //write system calls issued (pwrite, pwritev)
+    u64 bytes_read;
+    u64 bytes_written;
+    u64 syncs;         //fdatasync and msync calls issued
+} io_stats;
+
+typedef struct memory_stats {
+    u64 allocations;    //heap allocations made by file operations
+    u64 handles_reused; //file handles taken from the pool
+} memory_stats;
+
+typedef struct fsck_report {
+    u32 files;             //valid inodes checked
+    u32 double_allocated;  //blocks used by more than one file or twice by one file
+    u32 bad_pointers;      //extents and extent chain links pointing outside of data blocks
+    u32 bad_sizes;         //files whose size does not match the number of their blocks
+    u32 bitmap_mismatches; //blocks whose bit in the free block bitmap is wrong
+    u32 bad_root;          //1 if the root inode is not a directory
+} fsck_report;
+
+typedef struct async_stats {
+    u64 submitted;
+    u64 completed;
+    u64 full_waits;    //submissions that waited for a request to finish
+    u32 queue_depth;   //requests allowed in flight
+    u32 max_in_flight; //most requests in flight seen at once
+} async_stats;
+
+typedef struct op_stats {
+    u64 blocks_read;    //blocks read from disk or copied out of the mapped disk
+    u64 blocks_written; //blocks written to disk or copied into the mapped disk
+    u64 bytes_copied;   //bytes copied between caller buffers and the block cache or the mapped disk
+    u64 alloc_searches; //free block and free extent searches
+    u64 alloc_scanned;  //bitmap words looked at by them
+    u64 inode_reads;
+    u64 inode_writes;
+} op_stats;
+
+typedef struct latency_histogram {
+    u64 count;
+    u64 total_ns;
+    u64 max_ns;
+    u64 buckets[SFS_HISTOGRAM_BUCKETS];
+} latency_histogram;
+
+//everything counted by one filesystem
+typedef struct sfs_stats {
+    cache_stats       cache;
+    io_stats          io;
+    memory_stats      memory;
+    async_stats       async;
+    op_stats          ops;
+    latency_histogram read_latency;  //sfs_read_file
+    latency_histogram write_latency; //sfs_write_file
+    latency_histogram open_latency;  //sfs_open_file
+    latency_histogram mount_latency; //open_sfs
+} sfs_stats;
+
+typedef struct sfs_request sfs_request;
 
 typedef struct SFS {
     u32 magic;        //sfs header
     u32 blocks;       //number of blocks
-    u32 inode_blocks; //number of blocks set aside for storing inodes, 10% of total blocks rounding up
+    u32 inode_blocks; //number of blocks set aside for storing inodes, one inode per bytes_per_inode of the disk rounding up
     u32 inodes;       //number of inodes in inodes blocks
+    u32 version;      //on-disk format version, SFS_VERSION
+    u32 bitmap_blocks; //number of blocks holding the free block bitmap, they follow the inode blocks
+    u32 clean;        //1 - unmounted cleanly, 0 - mounted or crashed, journal is replayed at mount
+    u32 journal_blocks; //number of blocks of the metadata journal, they follow the bitmap
+    u32 block_size;   //power of two from SFS_MIN_BLOCK_SIZE to SFS_MAX_BLOCK_SIZE
+    u32 bytes_per_inode; //disk bytes per inode the inode table was sized for
     
     FILE* disk;
     
+    u32   block_shift; //log2 of block_size
+    
+    u8    io_mode;    //SFS_IO_STDIO or SFS_IO_MMAP
+    char* map;        //mapped disk, only in SFS_IO_MMAP mode
+    u64   map_size;
+    
+    //one bit per block, 1 - allocated, bits past the last block are kept allocated
+    //bitmap blocks are read on first use, mount does not depend on the size of the disk
+    u64*  free_block_bitmap;
+    u64*  bitmap_loaded;                         //one bit per bitmap block, 1 - read from disk
+    u64*  bitmap_full;                           //one bit per bitmap block, 1 - no free block in it, searches skip it
+    u32   alloc_cursor;                          //next-fit hint, block index where the next search starts
+    pthread_mutex_t alloc_lock;                  //bitmap and cursor
+    
+    //metadata journal, inode, bitmap and extent blocks reach their place on disk only through it
+    u64*  bitmap_dirty;                          //one bit per bitmap block, 1 - modified since the last commit
+    u64*  pending_free;                          //blocks freed since the last commit, they are reused after it
+    u64*  pending_dirty;                         //one bit per bitmap block, 1 - some of its blocks are in pending_free
+    u32   pending_free_num;
+    u32   inode_dirty_num;                       //inode blocks modified since the last commit
+    u32*  journal_targets;                       //extent blocks written since the last commit
+    char* journal_images;                        //their contents
+    u32   journal_num;
+    u32   journal_capacity;
+    pthread_mutex_t  journal_mutex;              //journal targets and images
+    pthread_rwlock_t journal_lock;               //held shared by metadata updates, exclusively by commit
+    char* journal_buffer;                        //descriptor and block images of the commit being written
+    u8    io_failed;                             //1 - a write or sync of the disk failed, commits report SFS_EIO and the disk is not marked clean
+    
+    //inode updates are serialized per inode, inodes share locks by index
+    pthread_mutex_t inode_locks[SFS_INODE_LOCKS];
+    
+    //inode table cache, inode blocks are loaded on first use and written back at sync
+    inode** inode_pages;                         //loaded inode blocks, NULL if not loaded yet
+    u32*    inode_loaded;                        //indexes of loaded inode blocks, they are released at unmount
+    u32     inode_loaded_num;
+    u64*    inode_dirty;                         //one bit per inode block, 1 - modified
+    u32     inode_cursor;                        //next-fit hint for free inode search
+    pthread_mutex_t inode_table_lock;            //inode pages, dirty bits and inode cursor
+    
+    //block cache, only in SFS_IO_STDIO mode
+    cache_block cache[SFS_CACHE_BLOCKS];
+    int         cache_buckets[SFS_CACHE_BLOCKS]; //hash chains heads, -1 if empty
+    char*       cache_memory;
+    u32         cache_hand;                      //clock hand
+    cache_stats cache_counters;
+    io_stats    io_counters;
+    pthread_mutex_t cache_lock;                  //cache slots, hash chains, clock hand and cache counters
+    
+    //closed file handles, see SFS_HANDLE_POOL
+    struct file*    handle_pool[SFS_HANDLE_POOL];
+    u32             handle_pool_num;
+    memory_stats    memory_counters;
+    pthread_mutex_t handle_pool_lock;            //handle pool
+    
+    //asynchronous requests, queued in submission order
+    sfs_request*    async_head;
+    sfs_request*    async_tail;
+    u32             async_depth;                 //submission waits while this many requests are in flight
+    u32             async_in_flight;             //queued and running requests
+    u32             async_threads_num;           //started worker threads
+    u8              async_stop;                  //workers exit when the queue is empty
+    pthread_t       async_threads[SFS_ASYNC_THREADS];
+    async_stats     async_counters;
+    pthread_mutex_t async_lock;                  //queue, counters and done flags of requests
+    pthread_cond_t  async_queued;                //request queued or workers stopped
+    pthread_cond_t  async_finished;              //request done
+    
+    //instrumentation, see SFS_STATS
+    op_stats          op_counters;
+    latency_histogram read_latency;
+    latency_histogram write_latency;
+    latency_histogram open_latency;
+    latency_histogram mount_latency;
+    FILE*             stats_out;                 //target of the periodic dump
+    u32               stats_interval;            //milliseconds between dumps, 0 - no dump thread
+    pthread_t         stats_thread;
+    pthread_mutex_t   stats_lock;                //dump settings
+    pthread_cond_t    stats_wake;                //dump settings changed
+    
     //remainder of disk block is filled with 0
-    //could be used for free blocks bitmap
     
 } SFS;
 
-static SFS sfs;
-
-typedef struct inode {
-    u32 valid;       //1 - has been created, 0 - not
-    u32 size;        //size of data in inode
-    u32 direct[5];   //direct pointers to data blocks
-    u32 indirect;    //indirect pointer to poiters to data
-} inode;
+//only fields before the disk pointer are stored on disk
+#define SFS_HEADER_SIZE        offsetof(SFS, disk)
 
 typedef struct file {
+    SFS*  fs;         //filesystem the file belongs to
     inode node;
-    u32   data_pointer;
+    u64   data_pointer;
     u32   inumber;
+    
+    //decoded copy of all extents, loaded on first access
+    //extent chain is written back by every write that changed it
+    extent* extents;
+    u32*    extent_starts;    //first file block covered by each extent
+    u32     extents_capacity;
+    u32*    chain;            //blocks of the extent chain
+    u32     chain_num;
+    u32     chain_capacity;
+    u32     first_dirty;      //first changed extent, the ones before it are already on disk
+    u8      extents_loaded;
+    u8      extents_dirty;
+    
+    //read-ahead of sfs_read_file
+    u64     readahead_next;   //data pointer the next sequential read starts at
+    u32     readahead_window; //blocks prefetched past the read, 0 - reads are not sequential
+    u32     readahead_end;    //first file block not prefetched yet
+    u8      readahead_cached; //1 - reads go through the block cache to use the prefetched blocks
+    
+    //small appends waiting for sfs_flush_file, blocks are allocated when they are written
+    char*   append_buffer;
+    u32     append_buffered;
+    u32     append_capacity;
 } sfs_file;
 
 
 
-void format_sfs(char* emu_disk_file, u32 disk_size); //erases disk and fills it with zeros
-void open_sfs  (char* emu_disk_file);                //opens and recalculates free block bitmap
-void close_sfs ();
+//every opened disk is an independent filesystem, any number of them can be open at once
+
+sfs_status format_sfs(char* emu_disk_file, u64 disk_size, u32 block_size, u32 bytes_per_inode, u8 format_mode); //erases disk, all blocks read as zeros, 0 sizes select the defaults
+SFS*       open_sfs  (char* emu_disk_file, u8 io_mode); //opens and loads free block bitmap, replays journal after unclean shutdown, NULL on failure
+sfs_status close_sfs (SFS* fs);                         //waits for asynchronous requests, commits journal, marks disk clean and frees the handle
+sfs_status sync_sfs  (SFS* fs);                         //commits metadata journal, everything written so far survives a crash, SFS_EIO if a write was lost
+
+u32 read_block (SFS* fs, void* buffer, u32 block_index, u32 size);
+u32 write_block(SFS* fs, void* buffer, u32 block_index, u32 size);
+
+u32 read_blocks (SFS* fs, void* buffer, u32 first_block, u32 count); //reads count contiguous blocks with one I/O
+u32 write_blocks(SFS* fs, void* buffer, u32 first_block, u32 count); //writes count contiguous blocks with one I/O
 
-u32 read_block (void* buffer, u32 block_index, u32 size);
-u32 write_block(void* buffer, u32 block_index, u32 size);
+u32 get_free_node(SFS* fs);                          //returns free block index, 0 if disk is full
+u32 get_free_extent(SFS* fs, u32 count, u32* length); //returns first block of a free run of at most count blocks
 
-u32 get_free_node();
+u32  reserve_blocks(SFS* fs, u32* blocks, u32 count); //claims count distinct blocks, all or nothing
+void release_blocks(SFS* fs, u32* blocks, u32 count); //returns blocks to the free pool
+
+void get_cache_stats(SFS* fs, cache_stats* stats);
+void get_io_stats   (SFS* fs, io_stats* stats);
+void get_memory_stats(SFS* fs, memory_stats* stats);
+
+u32  fsck_sfs(SFS* fs, fsck_report* report);         //returns number of problems found, they are also logged
 
 
 
 /*FILE IMPLEMENTATION*/
 
-sfs_file* sfs_open_file (u32 index, u8 mode);
-void sfs_delet_file(u32 index);
-void sfs_close_file(sfs_file* file);
+//all calls are thread safe, one sfs_file handle must not be used by two threads at once
+
+sfs_file*  sfs_open_file (SFS* fs, u32 index, u8 mode);
+sfs_status sfs_delet_file(SFS* fs, u32 index);         //SFS_EISDIR for directories, they are removed by sfs_unlink
+sfs_status sfs_close_file(sfs_file* file);             //writes buffered appends, the handle is released even if that fails
 
 u32  sfs_read_file (void* buffer, u32 size, sfs_file* file);
-u32  sfs_write_file(void* buffer, u32 size, sfs_file* file);
+u32  sfs_write_file(void* buffer, u32 size, sfs_file* file); //small appends are buffered until close, flush or another call on the handle
+
+u32  sfs_flush_file(sfs_file* file);                                 //writes buffered appends, 0 on failure, unwritten ones stay buffered
+
+u32  sfs_pread (sfs_file* file, void* buffer, u32 size, u64 offset); //data pointer is not moved
+u32  sfs_pwrite(sfs_file* file, void* buffer, u32 size, u64 offset); //offset must not be past end of file
+
+u64  sfs_file_size (sfs_file* file);
+void sfs_file_seek (sfs_file* file, u64 offset);
+u64  sfs_file_tell (sfs_file* file);
+
+
+
+/*ASYNC I/O*/
+
+//requests are served by a pool of SFS_ASYNC_THREADS threads, every request runs sfs_pread or sfs_pwrite
+//reads of one handle can be in flight together, a write must be the only request of its handle
+//request memory and its handle belong to the caller, they must stay valid until the request is done
+
+typedef void (*sfs_callback)(sfs_request* request);
+
+struct sfs_request {
+    SFS*         fs;        //handle may be written by a worker meanwhile, waiting looks only here
+    sfs_file*    file;
+    void*        buffer;
+    u32          size;
+    u64          offset;
+    u8           write;
+    u32          result;    //bytes transferred, valid once the request is done
+    sfs_status   status;    //why result is short, SFS_OK also for a read cut short by the end of the file
+    u8           done;      //read it with sfs_request_done
+    sfs_callback callback;  //called on the worker thread before the request is marked done, may be NULL
+    void*        user_data;
+    sfs_request* next;      //queue link
+};
+
+//submission blocks while the queue is full, requests are started in submission order
+void sfs_pread_async (sfs_file* file, void* buffer, u32 size, u64 offset, sfs_request* request, sfs_callback callback, void* user_data);
+void sfs_pwrite_async(sfs_file* file, void* buffer, u32 size, u64 offset, sfs_request* request, sfs_callback callback, void* user_data);
+
+bool sfs_request_done(sfs_request* request);           //polls the request
+u32  sfs_wait_request(sfs_request* request);           //blocks until the request is done, returns its result
+
+void sfs_set_queue_depth(SFS* fs, u32 depth);          //requests allowed in flight, at least 1
+void get_async_stats    (SFS* fs, async_stats* stats);
+
+
+
+/*STATISTICS*/
+
+//counters and histograms are per filesystem and never reset, callers subtract two snapshots
+
+void sfs_get_stats     (SFS* fs, sfs_stats* stats);
+void sfs_dump_stats    (SFS* fs, FILE* out);                  //prints sfs_get_stats as text
+void sfs_set_stats_dump(SFS* fs, FILE* out, u32 interval_ms); //dumps stats to out every interval_ms on a thread, 0 stops it
+
+u64  sfs_latency_percentile(latency_histogram* histogram, u32 percent); //upper bound of the bucket holding the percentile in ns, 0 if empty
+
+
+
+/*DIRECTORY IMPLEMENTATION*/
+
+//paths are separated by '/' and start at the root directory
+//inodes of created files are picked by the filesystem, numbered files should not be mixed with paths
+
+sfs_file* sfs_open_path(SFS* fs, char* path, u8 mode);  //like sfs_open_file, SFS_MODE_WRITE creates missing file
+u32  sfs_mkdir (SFS* fs, char* path);                   //returns inode of the new directory, 0 on failure
+u32  sfs_unlink(SFS* fs, char* path);                   //removes file or empty directory, 0 on failure
 
-u32  sfs_file_size (sfs_file* file);
-void sfs_file_seek (sfs_file* file, u32 offset);
-u32  sfs_file_tell (sfs_file* file);
+sfs_file* sfs_opendir(SFS* fs, char* path);             //close with sfs_close_file
+u32  sfs_readdir(sfs_file* dir, dir_entry* entry);      //returns 0 after the last entry, directory must not change meanwhile
 
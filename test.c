@@ -0,0 +1,604 @@
+
+#include <string.h>
+
+#include "sfs.h"
+
+#define TEST_DISK              "test.sfs"
+#define TEST_DISK_BLOCKS       3000
+#define TEST_MAX_BLOCKS        1029
+#define TEST_MAX_REQUEST       9000
+#define TEST_SEEDS             20
+#define TEST_OPERATIONS        400
+#define TEST_MAX_FILE          (16 * 1024 * 1024)
+#define TEST_FULL_BLOCKS       512
+#define TEST_PROPERTY_DISK     (12000 * BLOCK_SIZE) //bytes, the same for every block size
+#define TEST_DIR_FILES         100
+#define TEST_REPLAY_BLOCKS     40
+#define TEST_ASYNC_REQUESTS    8
+
+static u32 random_state = 1;
+
+static u32 next_random() {
+    
+    random_state = random_state * 1103515245 + 12345;
+    
+    return random_state >> 8;
+}
+
+static u32 failures;
+
+static void check(bool ok, char* test, u8 io_mode, u32 block_size, char* what, u32 value) {
+    
+    if(ok) { return; }
+    
+    fprintf(stderr, "%s %s %u: %s (%u)\n", test, (io_mode == SFS_IO_MMAP) ? "mmap" : "stdio", block_size, what, value);
+    
+    failures++;
+}
+
+static void test_format(u64 disk_size, u32 block_size) {
+    
+    sfs_status status = format_sfs(TEST_DISK, disk_size, block_size, SFS_BYTES_PER_INODE, SFS_FORMAT_SPARSE);
+    
+    if(status != SFS_OK) {
+        fprintf(stderr, "sfs_test: cannot format %s: %s\n", TEST_DISK, sfs_strerror(status));
+        exit(1);
+    }
+}
+
+static SFS* test_mount(u8 io_mode) {
+    
+    SFS* fs = open_sfs(TEST_DISK, io_mode);
+    
+    if(fs == NULL) {
+        fprintf(stderr, "sfs_test: cannot mount %s: %s\n", TEST_DISK, sfs_strerror(sfs_last_error()));
+        exit(1);
+    }
+    
+    return fs;
+}
+
+//writes files of 1 to TEST_MAX_BLOCKS blocks over each other and reads every one back
+//odd sizes end inside a block, are written in random requests and read after a remount
+static void test_blocks(u8 io_mode, u32 block_size) {
+    
+    u32 sizes[] = { 1, 2, 4, 5, 6, 7, 100, 1028, TEST_MAX_BLOCKS };
+    
+    char* written = malloc(TEST_MAX_BLOCKS * block_size);
+    char* read    = malloc(TEST_MAX_BLOCKS * block_size);
+    
+    test_format((u64)TEST_DISK_BLOCKS * block_size, block_size);
+    
+    SFS* fs = test_mount(io_mode);
+    
+    for(u32 i = 0; i < sizeof(sizes) / sizeof(u32); i++) {
+        
+        u32 size  = sizes[i] * block_size - (i % 2) * 17;
+        u32 index = i % 3 + 1;
+        u32 done  = 0;
+        
+        for(u32 j = 0; j < size; j++) {
+            written[j] = next_random();
+        }
+        
+        sfs_file* file = sfs_open_file(fs, index, SFS_MODE_WRITE);
+        
+        for(u32 offset = 0; file != NULL && offset < size;) {
+            
+            u32 request = (i % 2) ? next_random() % TEST_MAX_REQUEST + 1 : size;
+            
+            if(request > size - offset) { request = size - offset; }
+            
+            done   += sfs_write_file(written + offset, request, file);
+            offset += request;
+        }
+        
+        check(file != NULL && sfs_close_file(file) == SFS_OK && done == size, "blocks", io_mode, block_size, "write failed, blocks", sizes[i]);
+        
+        if(i % 2) {
+            close_sfs(fs);
+            fs = test_mount(io_mode);
+        }
+        
+        memset(read, 0, size);
+        
+        file = sfs_open_file(fs, index, SFS_MODE_READ);
+        done = (file != NULL) ? sfs_read_file(read, size, file) : 0;
+        
+        if(file != NULL) {
+            sfs_close_file(file);
+        }
+        
+        check(done == size && memcmp(written, read, size) == 0, "blocks", io_mode, block_size, "data read back differ, blocks", sizes[i]);
+    }
+    
+    fsck_report report = { 0 };
+    
+    check(fsck_sfs(fs, &report) == 0, "blocks", io_mode, block_size, "fsck found problems", 0);
+    
+    close_sfs(fs);
+    
+    free(written);
+    free(read);
+}
+
+//request length, mostly around block boundaries and small, sometimes spanning many blocks
+static u32 random_length(u32 block_size) {
+    
+    switch(next_random() % 6) {
+        case 0:  return next_random() % 3;
+        case 1:  return next_random() % block_size;
+        case 2:  return block_size - 1 + next_random() % 3;
+        case 3:  return next_random() % (5 * block_size);
+        case 4:  return next_random() % (70 * block_size);
+        default: return next_random() % 200;
+    }
+}
+
+//random appends, pwrites, preads, seeks, sequential reads and remounts of one file checked against a copy in memory
+static void test_property(u8 io_mode, u32 block_size) {
+    
+    char* reference = malloc(TEST_MAX_FILE);
+    char* source    = malloc(TEST_MAX_FILE);
+    char* buffer    = malloc(TEST_MAX_FILE);
+    
+    for(u32 seed = 1; seed <= TEST_SEEDS; seed++) {
+        
+        random_state = seed;
+        
+        u32  size    = 0;
+        u32  pointer = 0;
+        bool ok      = true;
+        
+        test_format(TEST_PROPERTY_DISK, block_size);
+        
+        SFS*      fs   = test_mount(io_mode);
+        sfs_file* file = sfs_open_file(fs, 3, SFS_MODE_WRITE);
+        
+        for(u32 i = 0; ok && i < TEST_OPERATIONS; i++) {
+            
+            u32 operation = next_random() % 7;
+            u32 length    = random_length(block_size);
+            u32 offset    = (size != 0) ? next_random() % (size + 1) : 0;
+            
+            //some requests start past the end of the file
+            if(next_random() % 8 == 0) { offset = size + next_random() % (2 * block_size); }
+            
+            //bytes expected from a read at offset or at the data pointer
+            u32 at_offset  = (offset  < size) ? ((length < size - offset)  ? length : size - offset)  : 0;
+            u32 at_pointer = (pointer < size) ? ((length < size - pointer) ? length : size - pointer) : 0;
+            
+            for(u32 j = 0; j < length; j++) {
+                source[j] = next_random();
+            }
+            
+            switch(operation) {
+                case 0:
+                    if(size + length > TEST_MAX_FILE) { break; }
+                    
+                    ok = sfs_write_file(source, length, file) == length;
+                    
+                    memcpy(reference + size, source, length);
+                    size += length;
+                    break;
+                case 1:
+                    if(offset > size || offset + length > TEST_MAX_FILE) { break; }
+                    
+                    ok = sfs_pwrite(file, source, length, offset) == length;
+                    
+                    memcpy(reference + offset, source, length);
+                    if(offset + length > size) { size = offset + length; }
+                    break;
+                case 2:
+                case 3:
+                    ok = sfs_pread(file, buffer, length, offset) == at_offset && memcmp(buffer, reference + offset, at_offset) == 0;
+                    break;
+                case 4:
+                    pointer = offset;
+                    sfs_file_seek(file, pointer);
+                    break;
+                case 5:
+                    ok = sfs_read_file(buffer, length, file) == at_pointer && memcmp(buffer, reference + pointer, at_pointer) == 0;
+                    
+                    pointer += at_pointer;
+                    ok       = ok && sfs_file_tell(file) == pointer;
+                    break;
+                default:
+                    if(next_random() % 4 != 0) { break; }
+                    
+                    //a write handle would truncate, the file is reopened for reading and appended to through it
+                    ok = sfs_close_file(file) == SFS_OK;
+                    
+                    if(next_random() % 2) {
+                        close_sfs(fs);
+                        fs = test_mount(io_mode);
+                    }
+                    
+                    file    = sfs_open_file(fs, 3, SFS_MODE_READ);
+                    pointer = 0;
+                    ok      = ok && file != NULL;
+            }
+            
+            ok = ok && sfs_file_size(file) == size;
+            
+            check(ok, "property", io_mode, block_size, "file differs from the reference, seed", seed);
+        }
+        
+        if(file != NULL) {
+            sfs_close_file(file);
+        }
+        
+        fsck_report report = { 0 };
+        
+        check(fsck_sfs(fs, &report) == 0, "property", io_mode, block_size, "fsck found problems, seed", seed);
+        
+        close_sfs(fs);
+    }
+    
+    free(reference);
+    free(source);
+    free(buffer);
+}
+
+//writes size bytes at the end of the file one block at a time, returns bytes written
+static u32 fill_file(sfs_file* file, char* data, u32 size) {
+    
+    u32 written = 0;
+    
+    while(written < size && sfs_pwrite(file, data + written, BLOCK_SIZE, written) == BLOCK_SIZE) {
+        written += BLOCK_SIZE;
+    }
+    
+    return written;
+}
+
+//on a full disk the blocks of a truncated or deleted file are reused before they are committed
+//the small file frees too few blocks for the journal to commit on its own
+static void test_full_disk(u8 io_mode) {
+    
+    char* data = malloc(TEST_FULL_BLOCKS * BLOCK_SIZE);
+    char* read = malloc(TEST_FULL_BLOCKS * BLOCK_SIZE);
+    
+    for(u32 i = 0; i < TEST_FULL_BLOCKS * BLOCK_SIZE; i++) {
+        data[i] = next_random();
+    }
+    
+    test_format(TEST_FULL_BLOCKS * BLOCK_SIZE, BLOCK_SIZE);
+    
+    SFS* fs = test_mount(io_mode);
+    
+    sfs_file* small = sfs_open_path(fs, "/small", SFS_MODE_WRITE);
+    u32       size  = fill_file(small, data, TEST_FULL_BLOCKS / 32 * BLOCK_SIZE);
+    
+    sfs_close_file(small);
+    
+    sfs_file* big   = sfs_open_path(fs, "/big", SFS_MODE_WRITE);
+    u32       taken = fill_file(big, data, TEST_FULL_BLOCKS * BLOCK_SIZE);
+    
+    sfs_close_file(big);
+    sync_sfs(fs);
+    
+    check(size == TEST_FULL_BLOCKS / 32 * BLOCK_SIZE && taken != 0 && taken < TEST_FULL_BLOCKS * BLOCK_SIZE, "full disk", io_mode, BLOCK_SIZE, "disk was not filled, bytes", taken);
+    
+    //truncate and rewrite
+    small = sfs_open_path(fs, "/small", SFS_MODE_WRITE);
+    
+    u32 done = sfs_write_file(data, size, small);
+    
+    check(sfs_close_file(small) == SFS_OK && done == size, "full disk", io_mode, BLOCK_SIZE, "rewrite of truncated file failed, bytes", done);
+    
+    //delete and create another file
+    check(sfs_unlink(fs, "/small") != 0, "full disk", io_mode, BLOCK_SIZE, "unlink failed", 0);
+    
+    small = sfs_open_path(fs, "/other", SFS_MODE_WRITE);
+    done  = (small != NULL) ? sfs_write_file(data, size, small) : 0;
+    
+    check(small != NULL && sfs_close_file(small) == SFS_OK && done == size, "full disk", io_mode, BLOCK_SIZE, "file replacing deleted one failed, bytes", done);
+    
+    small = sfs_open_path(fs, "/other", SFS_MODE_READ);
+    done  = (small != NULL) ? sfs_read_file(read, size, small) : 0;
+    
+    if(small != NULL) {
+        sfs_close_file(small);
+    }
+    
+    check(done == size && memcmp(data, read, size) == 0, "full disk", io_mode, BLOCK_SIZE, "data read back differ, bytes", done);
+    
+    fsck_report report = { 0 };
+    
+    check(fsck_sfs(fs, &report) == 0, "full disk", io_mode, BLOCK_SIZE, "fsck found problems", 0);
+    
+    close_sfs(fs);
+    
+    free(data);
+    free(read);
+}
+
+//nested directories survive a remount, tables grow past their first block, only empty directories are removed
+static void test_directories(u8 io_mode) {
+    
+    char data[BLOCK_SIZE];
+    char read[BLOCK_SIZE];
+    char path[SFS_NAME_LENGTH];
+    
+    for(u32 i = 0; i < BLOCK_SIZE; i++) {
+        data[i] = next_random();
+    }
+    
+    test_format(TEST_DISK_BLOCKS * BLOCK_SIZE, BLOCK_SIZE);
+    
+    SFS* fs = test_mount(io_mode);
+    
+    check(sfs_mkdir(fs, "/a") != 0 && sfs_mkdir(fs, "/a/b") != 0, "directories", io_mode, BLOCK_SIZE, "mkdir failed", 0);
+    check(sfs_mkdir(fs, "/a") == 0 && sfs_last_error() == SFS_EEXIST, "directories", io_mode, BLOCK_SIZE, "existing directory created again", 0);
+    check(sfs_open_path(fs, "/a/missing/f", SFS_MODE_WRITE) == NULL, "directories", io_mode, BLOCK_SIZE, "file created in missing directory", 0);
+    
+    sfs_file* file = sfs_open_path(fs, "/a/b/f", SFS_MODE_WRITE);
+    u32       done = (file != NULL) ? sfs_write_file(data, BLOCK_SIZE, file) : 0;
+    
+    check(file != NULL && sfs_close_file(file) == SFS_OK && done == BLOCK_SIZE, "directories", io_mode, BLOCK_SIZE, "write failed, bytes", done);
+    
+    for(u32 i = 0; i < TEST_DIR_FILES; i++) {
+        
+        sprintf(path, "/a/f%u", i);
+        
+        file = sfs_open_path(fs, path, SFS_MODE_WRITE);
+        
+        check(file != NULL && sfs_close_file(file) == SFS_OK, "directories", io_mode, BLOCK_SIZE, "create failed, file", i);
+    }
+    
+    close_sfs(fs);
+    fs = test_mount(io_mode);
+    
+    file = sfs_open_path(fs, "/a/b/f", SFS_MODE_READ);
+    done = (file != NULL) ? sfs_read_file(read, BLOCK_SIZE, file) : 0;
+    
+    if(file != NULL) {
+        sfs_close_file(file);
+    }
+    
+    check(done == BLOCK_SIZE && memcmp(data, read, BLOCK_SIZE) == 0, "directories", io_mode, BLOCK_SIZE, "data read back differ, bytes", done);
+    
+    //every name is listed once
+    sfs_file* dir     = sfs_opendir(fs, "/a");
+    dir_entry entry;
+    u32       entries = 0;
+    u32       files   = 0;
+    
+    while(dir != NULL && sfs_readdir(dir, &entry) != 0) {
+        entries++;
+        files += entry.name[0] == 'f' && (u32)atoi(entry.name + 1) < TEST_DIR_FILES;
+    }
+    
+    if(dir != NULL) {
+        sfs_close_file(dir);
+    }
+    
+    check(entries == TEST_DIR_FILES + 1 && files == TEST_DIR_FILES, "directories", io_mode, BLOCK_SIZE, "readdir listed wrong entries, entries", entries);
+    
+    check(sfs_unlink(fs, "/a/b") == 0 && sfs_last_error() == SFS_ENOTEMPTY, "directories", io_mode, BLOCK_SIZE, "non-empty directory removed", 0);
+    check(sfs_delet_file(fs, SFS_ROOT_INODE) == SFS_EISDIR, "directories", io_mode, BLOCK_SIZE, "root directory deleted", 0);
+    
+    bool removed = sfs_unlink(fs, "/a/b/f") != 0 && sfs_unlink(fs, "/a/b") != 0;
+    
+    for(u32 i = 0; i < TEST_DIR_FILES; i++) {
+        
+        sprintf(path, "/a/f%u", i);
+        
+        removed = sfs_unlink(fs, path) != 0 && removed;
+    }
+    
+    removed = sfs_unlink(fs, "/a") != 0 && removed;
+    
+    check(removed && sfs_opendir(fs, "/a") == NULL, "directories", io_mode, BLOCK_SIZE, "unlink failed", 0);
+    
+    fsck_report report = { 0 };
+    
+    check(fsck_sfs(fs, &report) == 0 && report.files == 1, "directories", io_mode, BLOCK_SIZE, "fsck found problems, files", report.files);
+    
+    close_sfs(fs);
+}
+
+//crash after the commit point, blocks of the last commit did not reach their places and mount writes them from the journal
+static void test_journal_replay(u8 io_mode) {
+    
+    u32   size = TEST_REPLAY_BLOCKS * BLOCK_SIZE;
+    char* data = malloc(size);
+    char* read = malloc(size);
+    
+    for(u32 i = 0; i < size; i++) {
+        data[i] = next_random();
+    }
+    
+    test_format(TEST_DISK_BLOCKS * BLOCK_SIZE, BLOCK_SIZE);
+    
+    SFS* fs = test_mount(io_mode);
+    
+    sfs_file* file = (sfs_mkdir(fs, "/logs") != 0) ? sfs_open_path(fs, "/logs/replay", SFS_MODE_WRITE) : NULL;
+    u32       done = (file != NULL) ? sfs_write_file(data, size, file) : 0;
+    
+    check(file != NULL && sfs_close_file(file) == SFS_OK && done == size, "journal replay", io_mode, BLOCK_SIZE, "write failed, bytes", done);
+    check(sync_sfs(fs) == SFS_OK, "journal replay", io_mode, BLOCK_SIZE, "sync failed", 0);
+    
+    //the disk as the crash leaves it, still marked as mounted
+    u64   disk_size = (u64)fs->blocks * BLOCK_SIZE;
+    u32   journal   = 1 + fs->inode_blocks + fs->bitmap_blocks;
+    char* image     = malloc(disk_size);
+    FILE* disk      = fopen(TEST_DISK, "rb");
+    bool  copied    = disk != NULL && fread(image, 1, disk_size, disk) == disk_size;
+    
+    if(disk != NULL) {
+        fclose(disk);
+    }
+    
+    close_sfs(fs);
+    
+    //journal descriptor is magic, count, checksum and the targets of the block images
+    u32* descriptor = (u32*)(image + (u64)journal * BLOCK_SIZE);
+    u32  count      = copied ? descriptor[1] : 0;
+    
+    check(count != 0 && count <= BLOCK_SIZE / sizeof(u32) - 3, "journal replay", io_mode, BLOCK_SIZE, "last commit is not in the journal, blocks", count);
+    
+    for(u32 i = 0; count <= BLOCK_SIZE / sizeof(u32) - 3 && i < count; i++) {
+        
+        if(descriptor[3 + i] < disk_size / BLOCK_SIZE) {
+            memset(image + (u64)descriptor[3 + i] * BLOCK_SIZE, 0, BLOCK_SIZE);
+        }
+    }
+    
+    disk = fopen(TEST_DISK, "wb");
+    
+    check(disk != NULL && fwrite(image, 1, disk_size, disk) == disk_size && fclose(disk) == 0, "journal replay", io_mode, BLOCK_SIZE, "disk image cannot be written", 0);
+    
+    fs = test_mount(io_mode);
+    
+    file = sfs_open_path(fs, "/logs/replay", SFS_MODE_READ);
+    done = (file != NULL) ? sfs_read_file(read, size, file) : 0;
+    
+    if(file != NULL) {
+        sfs_close_file(file);
+    }
+    
+    check(done == size && memcmp(data, read, size) == 0, "journal replay", io_mode, BLOCK_SIZE, "data read back differ, bytes", done);
+    
+    fsck_report report = { 0 };
+    
+    check(fsck_sfs(fs, &report) == 0, "journal replay", io_mode, BLOCK_SIZE, "fsck found problems", 0);
+    
+    close_sfs(fs);
+    
+    free(data);
+    free(read);
+    free(image);
+}
+
+static void count_request(sfs_request* request) {
+    __atomic_add_fetch((u32*)request->user_data, 1, __ATOMIC_RELAXED);
+}
+
+//reads of one handle run together, a write runs alone, a write running out of space says why
+static void test_async(u8 io_mode) {
+    
+    u32   size = TEST_FULL_BLOCKS / 8 * BLOCK_SIZE;
+    u32   part = size / TEST_ASYNC_REQUESTS;
+    char* data = malloc(TEST_FULL_BLOCKS * BLOCK_SIZE);
+    char* read = malloc(size + BLOCK_SIZE);
+    
+    for(u32 i = 0; i < TEST_FULL_BLOCKS * BLOCK_SIZE; i++) {
+        data[i] = next_random();
+    }
+    
+    test_format(TEST_FULL_BLOCKS * BLOCK_SIZE, BLOCK_SIZE);
+    
+    SFS* fs = test_mount(io_mode);
+    
+    sfs_file*   file      = sfs_open_path(fs, "/async", SFS_MODE_WRITE);
+    sfs_request requests[TEST_ASYNC_REQUESTS];
+    u32         callbacks = 0;
+    
+    if(file == NULL) {
+        check(false, "async", io_mode, BLOCK_SIZE, "open failed", 0);
+        close_sfs(fs);
+        free(data);
+        free(read);
+        return;
+    }
+    
+    sfs_pwrite_async(file, data, size, 0, &requests[0], count_request, &callbacks);
+    
+    u32 done = sfs_wait_request(&requests[0]);
+    
+    check(done == size && requests[0].status == SFS_OK, "async", io_mode, BLOCK_SIZE, "write failed, bytes", done);
+    
+    //the last read runs past the end of the file
+    for(u32 i = 0; i < TEST_ASYNC_REQUESTS; i++) {
+        sfs_pread_async(file, read + i * part, part + ((i == TEST_ASYNC_REQUESTS - 1) ? BLOCK_SIZE : 0), i * part, &requests[i], count_request, &callbacks);
+    }
+    
+    for(u32 i = 0; i < TEST_ASYNC_REQUESTS; i++) {
+        
+        done = sfs_wait_request(&requests[i]);
+        
+        check(done == part && requests[i].status == SFS_OK && sfs_request_done(&requests[i]), "async", io_mode, BLOCK_SIZE, "read failed, request", i);
+    }
+    
+    check(memcmp(data, read, size) == 0, "async", io_mode, BLOCK_SIZE, "data read back differ", 0);
+    
+    //more than the whole disk
+    sfs_pwrite_async(file, data, TEST_FULL_BLOCKS * BLOCK_SIZE, size, &requests[0], count_request, &callbacks);
+    
+    done = sfs_wait_request(&requests[0]);
+    
+    check(done < TEST_FULL_BLOCKS * BLOCK_SIZE && requests[0].status == SFS_ENOSPC, "async", io_mode, BLOCK_SIZE, "write past the free space not reported, status", requests[0].status);
+    check(callbacks == TEST_ASYNC_REQUESTS + 2, "async", io_mode, BLOCK_SIZE, "callbacks missed, calls", callbacks);
+    
+    sfs_close_file(file);
+    
+    fsck_report report = { 0 };
+    
+    check(fsck_sfs(fs, &report) == 0, "async", io_mode, BLOCK_SIZE, "fsck found problems", 0);
+    
+    close_sfs(fs);
+    
+    free(data);
+    free(read);
+}
+
+//bitmap of the biggest disk has bits past its last block, they must never be free
+static void test_bitmap_bounds() {
+    
+    u64 blocks = 0xffffffff;
+    
+    check(format_sfs(TEST_DISK, (blocks + 1) * SFS_MIN_BLOCK_SIZE, SFS_MIN_BLOCK_SIZE, 0, SFS_FORMAT_SPARSE) != SFS_OK, "bitmap bounds", SFS_IO_STDIO, SFS_MIN_BLOCK_SIZE, "too many blocks accepted", 0);
+    check(format_sfs(TEST_DISK, blocks * SFS_MIN_BLOCK_SIZE, SFS_MIN_BLOCK_SIZE, 0, SFS_FORMAT_SPARSE) == SFS_OK, "bitmap bounds", SFS_IO_STDIO, SFS_MIN_BLOCK_SIZE, "format failed", 0);
+    
+    SFS* fs = test_mount(SFS_IO_STDIO);
+    
+    //last word of the bitmap, only its lowest 63 bits describe blocks
+    u64  word  = (blocks - 1) / BITMAP_WORD_BITS;
+    u32  block = 1 + fs->inode_blocks + word * sizeof(u64) / SFS_MIN_BLOCK_SIZE;
+    char data[SFS_MIN_BLOCK_SIZE];
+    u64  bits  = 0;
+    
+    check(read_block(fs, data, block, SFS_MIN_BLOCK_SIZE) == SFS_MIN_BLOCK_SIZE, "bitmap bounds", SFS_IO_STDIO, SFS_MIN_BLOCK_SIZE, "bitmap block cannot be read", block);
+    
+    memcpy(&bits, data + word * sizeof(u64) % SFS_MIN_BLOCK_SIZE, sizeof(u64));
+    
+    check(bits >> 63 == 1, "bitmap bounds", SFS_IO_STDIO, SFS_MIN_BLOCK_SIZE, "block past the end of the disk is free", 0);
+    
+    close_sfs(fs);
+}
+
+int main() {
+    
+    u32 block_sizes[] = { BLOCK_SIZE, SFS_MIN_BLOCK_SIZE, SFS_MAX_BLOCK_SIZE };
+    
+    for(u32 i = 0; i < sizeof(block_sizes) / sizeof(u32); i++) {
+        
+        test_blocks(SFS_IO_STDIO, block_sizes[i]);
+        test_blocks(SFS_IO_MMAP, block_sizes[i]);
+        
+        test_property(SFS_IO_STDIO, block_sizes[i]);
+        test_property(SFS_IO_MMAP, block_sizes[i]);
+    }
+    
+    test_full_disk(SFS_IO_STDIO);
+    test_full_disk(SFS_IO_MMAP);
+    
+    test_directories(SFS_IO_STDIO);
+    test_directories(SFS_IO_MMAP);
+    
+    test_journal_replay(SFS_IO_STDIO);
+    test_journal_replay(SFS_IO_MMAP);
+    
+    test_async(SFS_IO_STDIO);
+    test_async(SFS_IO_MMAP);
+    
+    test_bitmap_bounds();
+    
+    remove(TEST_DISK);
+    
+    printf("sfs_test: %s\n", (failures == 0) ? "ok" : "FAILED");
+    
+    return failures != 0;
+}